@@ -1,9 +1,18 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <vector>
 #include <thread>
 #include <mutex>
-#include <barrier>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <functional>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -11,60 +20,465 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-#define THREADS_NUMBER 2
-
 const int KERNEL_RADIUS = 8;
 const float sigma = 3.f;
 
-std::barrier bar(4);
+// Cache of normalized 1D Gaussian weight tables, one per (sigma, radius) pair.
+// A table is built the first time it is requested and reused by every later blur,
+// so the blur loops never call std::exp or divide by the sum of the weights.
+class GaussianKernelBank
+{
+public:
+	// Returns 2 * radius + 1 weights that sum to 1, indexed by offset + radius
+	static const float* get(float sigma, int radius)
+	{
+		static std::mutex mutex;
+		static std::map<std::pair<float, int>, std::vector<float>> tables;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<float>& weights = tables[{sigma, radius}];
+		if (weights.empty())
+		{
+			std::vector<double> raw(2 * radius + 1);
+			double sum_weight = 0.0;
+			for (int offset = -radius; offset <= radius; offset++)
+			{
+				raw[offset + radius] = std::exp(-(offset * offset) / (2.0 * sigma * sigma));
+				sum_weight += raw[offset + radius];
+			}
+
+			weights.resize(2 * radius + 1);
+			for (int i = 0; i < 2 * radius + 1; i++)
+			{
+				weights[i] = (float)(raw[i] / sum_weight);
+			}
+		}
+		return weights.data();
+	}
+};
+
+// Process-wide pool of worker threads. The threads are created once and reused by
+// every parallel blur instead of being spawned and joined on each call.
+// The pool starts with BLUR_THREADS threads if that environment variable is set,
+// otherwise with std::thread::hardware_concurrency(), and resize() changes it at runtime.
+class ThreadPool
+{
+public:
+	static ThreadPool& instance()
+	{
+		static ThreadPool pool(defaultThreadCount());
+		return pool;
+	}
+
+	~ThreadPool()
+	{
+		stop();
+	}
+
+	int size() const
+	{
+		return (int)threads.size();
+	}
+
+	void resize(int thread_count)
+	{
+		stop();
+		start(thread_count);
+	}
+
+	// Runs task(i) for every i in [0, count) and returns once all of them have finished.
+	// The calling thread runs queued tasks too while it waits.
+	void run(int count, const std::function<void(int)>& task)
+	{
+		std::atomic<int> remaining(count);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int i = 0; i < count; i++)
+			{
+				tasks.push_back([this, &task, &remaining, i] {
+					task(i);
+					if (--remaining == 0)
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						tasks_done.notify_all();
+					}
+				});
+			}
+		}
+		work_available.notify_all();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (remaining > 0)
+		{
+			if (!tasks.empty())
+			{
+				std::function<void()> job = std::move(tasks.front());
+				tasks.pop_front();
+				lock.unlock();
+				job();
+				lock.lock();
+			}
+			else
+			{
+				tasks_done.wait(lock, [&] { return remaining == 0 || !tasks.empty(); });
+			}
+		}
+	}
+
+private:
+	explicit ThreadPool(int thread_count)
+	{
+		start(thread_count);
+	}
+
+	static int defaultThreadCount()
+	{
+		const char* env = std::getenv("BLUR_THREADS");
+		if (env != nullptr && std::atoi(env) > 0)
+		{
+			return std::atoi(env);
+		}
+		return std::max(1, (int)std::thread::hardware_concurrency());
+	}
+
+	void start(int thread_count)
+	{
+		stopping = false;
+		for (int i = 0; i < thread_count; i++)
+		{
+			threads.emplace_back([this] { workerLoop(); });
+		}
+	}
+
+	// Lets the workers drain the queue, then joins them
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		work_available.notify_all();
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+		threads.clear();
+	}
+
+	void workerLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			work_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+			{
+				return;
+			}
+			std::function<void()> job = std::move(tasks.front());
+			tasks.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable work_available;
+	std::condition_variable tasks_done;
+	bool stopping = false;
+};
+
+// Tile edge in pixels for the work-stealing scheduler
+const int TILE_SIZE = 64;
+
+// Half-open pixel rectangle [x_begin, x_end) x [y_begin, y_end)
+struct Tile
+{
+	int x_begin, x_end;
+	int y_begin, y_end;
+};
+
+// Work-stealing scheduler for 2D tiles on top of the ThreadPool.
+// Every worker starts with its own contiguous run of tiles in a deque and takes tiles from the front.
+// A worker whose deque is empty steals the back half of another worker's deque, so a worker that is
+// slow or descheduled on a shared host only delays the tiles it is actually running.
+class TileScheduler
+{
+public:
+	TileScheduler(int width, int height, int tile_width, int tile_height, int worker_count)
+		: queues(std::max(1, worker_count))
+	{
+		std::vector<Tile> tiles;
+		for (int y = 0; y < height; y += tile_height)
+		{
+			for (int x = 0; x < width; x += tile_width)
+			{
+				tiles.push_back({ x, std::min(x + tile_width, width), y, std::min(y + tile_height, height) });
+			}
+		}
+
+		int worker_total = (int)queues.size();
+		for (int w = 0; w < worker_total; w++)
+		{
+			size_t first = tiles.size() * w / worker_total;
+			size_t last = tiles.size() * (w + 1) / worker_total;
+			queues[w].tiles.assign(tiles.begin() + first, tiles.begin() + last);
+		}
+	}
+
+	// Calls body(tile) once for every tile and returns when all tiles are done
+	void run(ThreadPool& pool, const std::function<void(const Tile&)>& body)
+	{
+		pool.run((int)queues.size(), [&](int worker) {
+			Tile tile;
+			while (popFront(worker, tile) || stealHalf(worker, tile))
+			{
+				body(tile);
+			}
+		});
+	}
+
+private:
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<Tile> tiles;
+	};
+
+	bool popFront(int worker, Tile& tile)
+	{
+		WorkerQueue& queue = queues[worker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tiles.empty())
+		{
+			return false;
+		}
+		tile = queue.tiles.front();
+		queue.tiles.pop_front();
+		return true;
+	}
+
+	// Moves the back half of the first non-empty victim deque into the thief's deque and hands out one tile.
+	// Tiles are never added after construction, so finding every deque empty means the thief is done.
+	bool stealHalf(int thief, Tile& tile)
+	{
+		int worker_total = (int)queues.size();
+		for (int i = 1; i < worker_total; i++)
+		{
+			WorkerQueue& victim = queues[(thief + i) % worker_total];
+			std::vector<Tile> stolen;
+			{
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				size_t steal_count = (victim.tiles.size() + 1) / 2;
+				stolen.assign(victim.tiles.end() - steal_count, victim.tiles.end());
+				victim.tiles.erase(victim.tiles.end() - steal_count, victim.tiles.end());
+			}
+			if (stolen.empty())
+			{
+				continue;
+			}
+
+			tile = stolen.front();
+			WorkerQueue& own = queues[thief];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			own.tiles.insert(own.tiles.end(), stolen.begin() + 1, stolen.end());
+			return true;
+		}
+		return false;
+	}
 
-unsigned char blur(int x, int y, int channel, unsigned char* input, int width, int height)
+	std::deque<WorkerQueue> queues;
+};
+
+// Dataflow scheduler on top of the ThreadPool. A task becomes runnable as soon as every task it
+// depends on has finished, so independent stages of a pipeline overlap instead of meeting at a barrier.
+class TaskGraph
+{
+public:
+	// Adds a task and returns its id
+	int add(std::function<void()> task)
+	{
+		nodes.push_back({ std::move(task), {}, 0 });
+		return (int)nodes.size() - 1;
+	}
+
+	// task may only start after prerequisite has finished
+	void dependsOn(int task, int prerequisite)
+	{
+		nodes[prerequisite].successors.push_back(task);
+		nodes[task].pending++;
+	}
+
+	// Runs every task once and returns when all of them have finished
+	void run(ThreadPool& pool)
+	{
+		finished = 0;
+		for (int id = 0; id < (int)nodes.size(); id++)
+		{
+			if (nodes[id].pending == 0)
+			{
+				ready.push_back(id);
+			}
+		}
+
+		pool.run(std::max(1, pool.size()), [this](int) {
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				ready_changed.wait(lock, [this] { return !ready.empty() || finished == (int)nodes.size(); });
+				if (ready.empty())
+				{
+					return;
+				}
+				int id = ready.front();
+				ready.pop_front();
+				lock.unlock();
+				nodes[id].task();
+				lock.lock();
+
+				// Newly released tasks go to the front so they run while their inputs are still in cache
+				finished++;
+				for (int successor : nodes[id].successors)
+				{
+					if (--nodes[successor].pending == 0)
+					{
+						ready.push_front(successor);
+					}
+				}
+				ready_changed.notify_all();
+			}
+		});
+	}
+
+private:
+	struct Node
+	{
+		std::function<void()> task;
+		std::vector<int> successors;
+		int pending;
+	};
+
+	std::vector<Node> nodes;
+	std::deque<int> ready;
+	int finished = 0;
+	std::mutex mutex;
+	std::condition_variable ready_changed;
+};
+
+// The 2D Gaussian is the outer product of the 1D kernel with itself, so its
+// normalized weights are products of the normalized 1D weights
+unsigned char blur(int x, int y, int channel, unsigned char* input, int width, int height, const float* weights)
 {
-	float sum_weight = 0.0f;
 	float ret = 0.f;
 
 	for (int offset_y = -KERNEL_RADIUS; offset_y <= KERNEL_RADIUS; offset_y++)
 	{
+		float weight_y = weights[offset_y + KERNEL_RADIUS];
 		for (int offset_x = -KERNEL_RADIUS; offset_x <= KERNEL_RADIUS; offset_x++)
 		{
 			int pixel_y = std::max(std::min(y + offset_y, height - 1), 0);
 			int pixel_x = std::max(std::min(x + offset_x, width - 1), 0);
 			int pixel = pixel_y * width + pixel_x;
 
-			float weight = std::exp(-(offset_x * offset_x + offset_y * offset_y) / (2.f * sigma * sigma));
-
-			ret += weight * input[4 * pixel + channel];
-			sum_weight += weight;
+			ret += weight_y * weights[offset_x + KERNEL_RADIUS] * input[4 * pixel + channel];
 		}
 	}
-	ret /= sum_weight;
 
 	return (unsigned char)std::max(std::min(ret, 255.f), 0.f);
 }
 
-unsigned char blurAxis(int x, int y, int channel, int axis/*0: horizontal axis, 1: vertical axis*/, unsigned char* input, int width, int height)
-{	
-	float sum_weight = 0.0f;
+unsigned char blurAxis(int x, int y, int channel, int axis/*0: horizontal axis, 1: vertical axis*/, unsigned char* input, int width, int height, const float* weights)
+{
 	float ret = 0.f;
 
 	for (int offset = -KERNEL_RADIUS; offset <= KERNEL_RADIUS; offset++)
-	{		
+	{
 		int offset_x = axis == 0 ? offset : 0;
 		int offset_y = axis == 1 ? offset : 0;
 		int pixel_y = std::max(std::min(y + offset_y, height - 1), 0);
 		int pixel_x = std::max(std::min(x + offset_x, width - 1), 0);
 		int pixel = pixel_y * width + pixel_x;
 
-		float weight = std::exp(-(offset * offset) / (2.f * sigma * sigma));
-
-		ret += weight * input[4 * pixel + channel];
-		sum_weight += weight;
+		ret += weights[offset + KERNEL_RADIUS] * input[4 * pixel + channel];
 	}
-	ret /= sum_weight;
 
 	return (unsigned char)std::max(std::min(ret, 255.f), 0.f);
 }
 
+// Blurs count interior pixels, which skip edge clamping: tap k is read at src + (k - KERNEL_RADIUS) * tap_stride.
+// Channels channel_begin to channel_end - 1 are blurred, so a worker can handle a single channel.
+void blurSpan(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const float* weights, int channel_begin, int channel_end)
+{
+	for (int i = 0; i < count; i++)
+	{
+		float ret[4] = { 0.f, 0.f, 0.f, 0.f };
+		const unsigned char* tap = src + 4 * i - KERNEL_RADIUS * tap_stride;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++, tap += tap_stride)
+		{
+			for (int channel = channel_begin; channel < channel_end; channel++)
+			{
+				ret[channel] += weights[k] * tap[channel];
+			}
+		}
+
+		for (int channel = channel_begin; channel < channel_end; channel++)
+		{
+			dst[4 * i + channel] = (unsigned char)std::max(std::min(ret[channel], 255.f), 0.f);
+		}
+	}
+}
+
+// Blurs row y along the horizontal axis. Only the first and last KERNEL_RADIUS pixels need clamped taps.
+void blurRowHorizontal(unsigned char* input, unsigned char* output, int y, int width, int height, const float* weights, int channel_begin, int channel_end)
+{
+	int interior_begin = std::min(KERNEL_RADIUS, width);
+	int interior_end = std::max(width - KERNEL_RADIUS, interior_begin);
+
+	for (int x = 0; x < interior_begin; x++)
+	{
+		int pixel = y * width + x;
+		for (int channel = channel_begin; channel < channel_end; channel++)
+		{
+			output[4 * pixel + channel] = blurAxis(x, y, channel, 0, input, width, height, weights);
+		}
+	}
+	if (interior_end > interior_begin)
+	{
+		int pixel = y * width + interior_begin;
+		blurSpan(input + 4 * pixel, output + 4 * pixel, interior_end - interior_begin, 4, weights, channel_begin, channel_end);
+	}
+	for (int x = interior_end; x < width; x++)
+	{
+		int pixel = y * width + x;
+		for (int channel = channel_begin; channel < channel_end; channel++)
+		{
+			output[4 * pixel + channel] = blurAxis(x, y, channel, 0, input, width, height, weights);
+		}
+	}
+}
+
+// Blurs row y along the vertical axis. Only the first and last KERNEL_RADIUS rows need clamped taps.
+void blurRowVertical(unsigned char* input, unsigned char* output, int y, int width, int height, const float* weights, int channel_begin, int channel_end)
+{
+	if (y >= KERNEL_RADIUS && y < height - KERNEL_RADIUS)
+	{
+		blurSpan(input + 4 * y * width, output + 4 * y * width, width, 4 * (std::ptrdiff_t)width, weights, channel_begin, channel_end);
+		return;
+	}
+
+	for (int x = 0; x < width; x++)
+	{
+		int pixel = y * width + x;
+		for (int channel = channel_begin; channel < channel_end; channel++)
+		{
+			output[4 * pixel + channel] = blurAxis(x, y, channel, 1, input, width, height, weights);
+		}
+	}
+}
+
 void gaussian_blur_serial(const char* filename)
 {
 	int width = 0;
@@ -80,6 +494,9 @@ void gaussian_blur_serial(const char* filename)
 
 	unsigned char* img_out = new unsigned char[width * height * 4];
 
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
 	// Timer to measure performance
 	auto start = std::chrono::high_resolution_clock::now();
 
@@ -91,7 +508,7 @@ void gaussian_blur_serial(const char* filename)
 			int pixel = y * width + x;
 			for (int channel = 0; channel < 4; channel++)
 			{
-				img_out[4 * pixel + channel] = blur(x, y, channel, img_in, width, height);
+				img_out[4 * pixel + channel] = blur(x, y, channel, img_in, width, height, weights);
 			}
 		}
 	}
@@ -110,16 +527,16 @@ void gaussian_blur_serial(const char* filename)
 }
 
 
-void calculate_pixels(int y_start, int y_end, unsigned char* img_in, int width, int height, unsigned char* img_out)
+void calculate_pixels(const Tile& tile, unsigned char* img_in, int width, int height, unsigned char* img_out, const float* weights)
 {
-	for (int y = y_start; y < y_end; y++)
+	for (int y = tile.y_begin; y < tile.y_end; y++)
 	{
-		for (int x = 0; x < width; x++)
+		for (int x = tile.x_begin; x < tile.x_end; x++)
 		{
 			int pixel = y * width + x;
 			for (int channel = 0; channel < 4; channel++)
 			{
-				img_out[4 * pixel + channel] = blur(x, y, channel, img_in, width, height);
+				img_out[4 * pixel + channel] = blur(x, y, channel, img_in, width, height, weights);
 			}
 		}
 	}
@@ -127,7 +544,7 @@ void calculate_pixels(int y_start, int y_end, unsigned char* img_in, int width,
 
 void gaussian_blur_parallel(const char* filename) 
 {
-	const int threads_number = THREADS_NUMBER;
+	ThreadPool& pool = ThreadPool::instance();
 	int width = 0;
 	int height = 0;
 	int img_orig_channels = 4;
@@ -139,27 +556,21 @@ void gaussian_blur_parallel(const char* filename)
 		return;
 	}
 
-	int chunk_size = height / threads_number;
-
 	unsigned char* img_out = new unsigned char[width * height * 4];
 
-	// Timer to measure performance
-	auto start = std::chrono::high_resolution_clock::now();
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
 
-	std::thread threads[threads_number];
-	for (int i = 0; i < threads_number;i++) {
-		int y_start = i * chunk_size;
-		int y_end = (i == threads_number - 1) ? height : y_start + chunk_size;
+	// One tile deque per pool thread; idle threads steal tiles from busy ones
+	TileScheduler scheduler(width, height, TILE_SIZE, TILE_SIZE, pool.size());
 
-		// Perform Gaussian Blur to the pixels of a number of rows
-		threads[i] = std::thread(calculate_pixels,y_start, y_end, img_in, width, height, img_out);
-	}
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
 
-	// Wait for all threads to finish
-	for (int i = 0; i < threads_number;i++) {
-		threads[i].join();
-	}
-	
+	// Perform Gaussian Blur to the pixels of each tile
+	scheduler.run(pool, [&](const Tile& tile) {
+		calculate_pixels(tile, img_in, width, height, img_out, weights);
+	});
 
 	// Timer to measure performance
 	auto end = std::chrono::high_resolution_clock::now();
@@ -196,32 +607,21 @@ void gaussian_blur_separate_serial(const char* filename)
 	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
 	unsigned char* img_out = new unsigned char[width * height * 4];
 
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
 	// Timer to measure performance
 	auto start = std::chrono::high_resolution_clock::now();
 
 	// Horizontal Blur
 	for (int y = 0; y < height; y++)
 	{
-		for (int x = 0; x < width; x++)
-		{
-			int pixel = y * width + x;
-			for (int channel = 0; channel < 4; channel++)
-			{
-				img_horizontal_blur[4 * pixel + channel] = blurAxis(x, y, channel, 0, img_in, width, height);
-			}
-		}
+		blurRowHorizontal(img_in, img_horizontal_blur, y, width, height, weights, 0, 4);
 	}
 	// Vertical Blur
 	for (int y = 0; y < height; y++)
 	{
-		for (int x = 0; x < width; x++)
-		{
-			int pixel = y * width + x;
-			for (int channel = 0; channel < 4; channel++)
-			{
-				img_out[4 * pixel + channel] = blurAxis(x, y, channel, 1, img_horizontal_blur, width, height);
-			}
-		}
+		blurRowVertical(img_horizontal_blur, img_out, y, width, height, weights, 0, 4);
 	}
 	// Timer to measure performance
 	auto end = std::chrono::high_resolution_clock::now();
@@ -237,60 +637,47 @@ void gaussian_blur_separate_serial(const char* filename)
 	delete[] img_out;
 }
 
-void worker(unsigned char* img_in, int width, int height, unsigned char max_channel_value[], unsigned char* img_normalized, unsigned char* img_horizontal_blur, unsigned char* img_out, int channel) {
-	unsigned char max_value = 0;
+// Rows per band for the row-partitioned separable pipeline. Every band covers whole image rows
+// with all four channels, so two threads never write to the same cache line except at a band edge.
+const int ROW_BAND_HEIGHT = 16;
 
-	for (int y = 0; y < height; y++)
+// Per-channel maxima of the rows in band, merged into max_channel_value
+void findChannelMax(const Tile& band, unsigned char* img_in, int width, unsigned char max_channel_value[], std::mutex& max_mutex)
+{
+	unsigned char band_max[4] = { 0, 0, 0, 0 };
+	for (int i = 4 * band.y_begin * width; i < 4 * band.y_end * width; i += 4)
 	{
-		for (int x = 0; x < width; x++)
+		for (int channel = 0; channel < 4; channel++)
 		{
-			int pixel = y * width + x;
-			
-			if (img_in[4 * pixel + channel] > max_value) {
-				max_value = img_in[4 * pixel + channel];
-			}
+			band_max[channel] = std::max(band_max[channel], img_in[i + channel]);
 		}
 	}
 
-	max_channel_value[channel] = max_value;
-
-	for (int y = 0; y < height; y++)
+	std::lock_guard<std::mutex> lock(max_mutex);
+	for (int channel = 0; channel < 4; channel++)
 	{
-		for (int x = 0; x < width; x++)
-		{
-			int pixel = y * width + x;
-			
-			img_normalized[4 * pixel + channel] = 255 * img_in[4 * pixel + channel] / max_channel_value[channel];
-		}
+		max_channel_value[channel] = std::max(max_channel_value[channel], band_max[channel]);
 	}
+}
 
-	// wait for normalized image to be completed
-	bar.arrive_and_wait();
-
-
-	// Horizontal blur on normalized image 
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int pixel = y * width + x;
-			img_horizontal_blur[4 * pixel + channel] = blurAxis(x, y, channel, 0, img_normalized, width, height);
+// Normalizes the rows in band by the per-channel maxima and blurs them horizontally.
+// The horizontal pass only reads the row it writes, so both steps run on the same band.
+void normalizeAndBlurHorizontal(const Tile& band, unsigned char* img_in, int width, int height, const unsigned char max_channel_value[], unsigned char* img_normalized, unsigned char* img_horizontal_blur, const float* weights)
+{
+	for (int i = 4 * band.y_begin * width; i < 4 * band.y_end * width; i += 4)
+	{
+		for (int channel = 0; channel < 4; channel++)
+		{
+			img_normalized[i + channel] = 255 * img_in[i + channel] / max_channel_value[channel];
 		}
 	}
 
-	// Wait for horizontal blur to complete
-	bar.arrive_and_wait();
-
-	// Vertical blur on horizontally blurred image
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int pixel = y * width + x;
-			img_out[4 * pixel + channel] = blurAxis(x, y, channel, 1, img_horizontal_blur, width, height);
-		}
+	for (int y = band.y_begin; y < band.y_end; y++)
+	{
+		blurRowHorizontal(img_normalized, img_horizontal_blur, y, width, height, weights, 0, 4);
 	}
-
-
 }
 
-
 void gaussian_blur_separate_parallel(const char* filename)
 {
 	unsigned char max_channel_value[4] = {0,0,0,0};
@@ -309,20 +696,50 @@ void gaussian_blur_separate_parallel(const char* filename)
 	unsigned char* img_out = new unsigned char[width * height * 4];
 	unsigned char* img_normalized = new unsigned char[width * height * 4];
 
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
 	// Timer to measure performance
 	auto start = std::chrono::high_resolution_clock::now();
 
-	std::thread thread1 = std::thread(worker, img_in, width, height, max_channel_value, img_normalized, img_horizontal_blur, img_out, 0);
-	std::thread thread2 = std::thread(worker, img_in, width, height, max_channel_value, img_normalized, img_horizontal_blur, img_out, 1);
-	std::thread thread3 = std::thread(worker, img_in, width, height, max_channel_value, img_normalized, img_horizontal_blur, img_out, 2);
-	std::thread thread4 = std::thread(worker, img_in, width, height, max_channel_value, img_normalized, img_horizontal_blur, img_out, 3);
+	ThreadPool& pool = ThreadPool::instance();
+	std::mutex max_mutex;
 
-	
+	// The normalization needs the maxima of the whole image, so they are found first
+	TileScheduler(width, height, width, ROW_BAND_HEIGHT, pool.size()).run(pool, [&](const Tile& band) {
+		findChannelMax(band, img_in, width, max_channel_value, max_mutex);
+	});
 
-	thread1.join();
-	thread2.join();
-	thread3.join();
-	thread4.join();
+	// Band b is blurred vertically as soon as the horizontal bands holding rows
+	// [y_begin - KERNEL_RADIUS, y_end + KERNEL_RADIUS) are done, while later bands are still being blurred horizontally
+	int band_count = (height + ROW_BAND_HEIGHT - 1) / ROW_BAND_HEIGHT;
+	TaskGraph pipeline;
+	std::vector<int> horizontal_tasks(band_count);
+	for (int b = 0; b < band_count; b++)
+	{
+		Tile band = { 0, width, b * ROW_BAND_HEIGHT, std::min((b + 1) * ROW_BAND_HEIGHT, height) };
+		horizontal_tasks[b] = pipeline.add([&, band] {
+			normalizeAndBlurHorizontal(band, img_in, width, height, max_channel_value, img_normalized, img_horizontal_blur, weights);
+		});
+	}
+	for (int b = 0; b < band_count; b++)
+	{
+		Tile band = { 0, width, b * ROW_BAND_HEIGHT, std::min((b + 1) * ROW_BAND_HEIGHT, height) };
+		int vertical_task = pipeline.add([&, band] {
+			for (int y = band.y_begin; y < band.y_end; y++)
+			{
+				blurRowVertical(img_horizontal_blur, img_out, y, width, height, weights, 0, 4);
+			}
+		});
+
+		int first_band = std::max(0, band.y_begin - KERNEL_RADIUS) / ROW_BAND_HEIGHT;
+		int last_band = std::min(height - 1, band.y_end - 1 + KERNEL_RADIUS) / ROW_BAND_HEIGHT;
+		for (int dependency = first_band; dependency <= last_band; dependency++)
+		{
+			pipeline.dependsOn(vertical_task, horizontal_tasks[dependency]);
+		}
+	}
+	pipeline.run(pool);
 
 	// Timer to measure performance
 	auto end = std::chrono::high_resolution_clock::now();
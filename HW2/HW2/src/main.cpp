@@ -1,6 +1,13 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -9,36 +16,2828 @@
 #include "stb_image_write.h"
 
 #include <omp.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 const int KERNEL_RADIUS = 8;
 const float sigma = 3.f;
+// Width in bytes of the column strips walked by the vertical pass. The 2 * KERNEL_RADIUS + 1
+// rows of a strip that one output row needs should fit in L1, so tune this to the cache size.
+const int VERTICAL_STRIP_BYTES = 1024;
+// Height of the row bands the strips are cut into for the parallel vertical pass. A strip
+// alone is too coarse a work item: a 2048 pixel wide image has only 8 of them. Each band
+// rereads 2 * KERNEL_RADIUS rows of its neighbours, so bands should stay well above that.
+const int VERTICAL_BAND_ROWS = 128;
+// Tile edge of the sparse bloom occupancy map. Tiles at least KERNEL_RADIUS wide keep the
+// blur of a tile inside its 8 neighbours, and a multiple of 4 keeps tile edges on the
+// 4-sample groups of the planar span kernels.
+const int BLOOM_TILE_SIZE = 32;
+static_assert(BLOOM_TILE_SIZE >= KERNEL_RADIUS && BLOOM_TILE_SIZE % 4 == 0, "bloom tiles must cover the kernel radius and whole sample groups");
+// Width in pixels of the column blocks that the recursive filter and the box passes filter
+// vertically in parallel. Every column is filtered independently, so blocks only need to span
+// whole cache lines; narrow blocks give enough work items for any core count.
+const int COLUMN_BLOCK_PIXELS = 16;
+// Levels of the dual-filter bloom mip chain, including the full resolution one
+const int BLOOM_MIP_LEVELS = 5;
+static_assert(BLOOM_MIP_LEVELS >= 2, "the dual-filter bloom needs at least one downsampled level");
 
+// Cache of normalized 1D Gaussian weight tables, one per (sigma, radius) pair.
+// A table is built the first time it is requested and reused by every later blur,
+// so the blur loops never call std::exp or divide by the sum of the weights.
+class GaussianKernelBank
+{
+public:
+	// Returns 2 * radius + 1 weights that sum to 1, indexed by offset + radius
+	static const float* get(float sigma, int radius)
+	{
+		static std::mutex mutex;
+		static std::map<std::pair<float, int>, std::vector<float>> tables;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<float>& weights = tables[{sigma, radius}];
+		if (weights.empty())
+		{
+			std::vector<double> raw(2 * radius + 1);
+			double sum_weight = 0.0;
+			for (int offset = -radius; offset <= radius; offset++)
+			{
+				raw[offset + radius] = std::exp(-(offset * offset) / (2.0 * sigma * sigma));
+				sum_weight += raw[offset + radius];
+			}
+
+			weights.resize(2 * radius + 1);
+			for (int i = 0; i < 2 * radius + 1; i++)
+			{
+				weights[i] = (float)(raw[i] / sum_weight);
+			}
+		}
+		return weights.data();
+	}
+
+	// Same table in Q0.15 fixed point for the integer blur. The taps are rounded
+	// and the center tap absorbs the rounding residue so they sum to exactly 1 << 15.
+	static const short* getFixed(float sigma, int radius)
+	{
+		static std::mutex mutex;
+		static std::map<std::pair<float, int>, std::vector<short>> tables;
+
+		const float* weights = get(sigma, radius);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<short>& fixed_weights = tables[{sigma, radius}];
+		if (fixed_weights.empty())
+		{
+			fixed_weights.resize(2 * radius + 1);
+			int sum_weight = 0;
+			for (int i = 0; i < 2 * radius + 1; i++)
+			{
+				fixed_weights[i] = (short)std::lround(weights[i] * (1 << 15));
+				sum_weight += fixed_weights[i];
+			}
+			fixed_weights[radius] = (short)std::min(fixed_weights[radius] + (1 << 15) - sum_weight, 32767);
+		}
+		return fixed_weights.data();
+	}
+};
+
+
+unsigned char blurAxis(int x, int y, int channel, int axis/*0: horizontal axis, 1: vertical axis*/, unsigned char* input, int width, int height, const float* weights)
+{
+	float ret = 0.f;
+
+	for (int offset = -KERNEL_RADIUS; offset <= KERNEL_RADIUS; offset++)
+	{
+		int offset_x = axis == 0 ? offset : 0;
+		int offset_y = axis == 1 ? offset : 0;
+		int pixel_y = std::max(std::min(y + offset_y, height - 1), 0);
+		int pixel_x = std::max(std::min(x + offset_x, width - 1), 0);
+		int pixel = pixel_y * width + pixel_x;
+
+		ret += weights[offset + KERNEL_RADIUS] * input[4 * pixel + channel];
+	}
+
+	return (unsigned char)std::max(std::min(ret, 255.f), 0.f);
+}
+
+// Fixed-point blurAxis: Q0.15 weights, 32-bit accumulator and a rounding shift back to 8 bits.
+// It rounds where the float version truncates, so each pass differs from the float blur by at most 1.
+unsigned char blurAxis(int x, int y, int channel, int axis/*0: horizontal axis, 1: vertical axis*/, unsigned char* input, int width, int height, const short* weights)
+{
+	int ret = 0;
+
+	for (int offset = -KERNEL_RADIUS; offset <= KERNEL_RADIUS; offset++)
+	{
+		int offset_x = axis == 0 ? offset : 0;
+		int offset_y = axis == 1 ? offset : 0;
+		int pixel_y = std::max(std::min(y + offset_y, height - 1), 0);
+		int pixel_x = std::max(std::min(x + offset_x, width - 1), 0);
+		int pixel = pixel_y * width + pixel_x;
+
+		ret += weights[offset + KERNEL_RADIUS] * input[4 * pixel + channel];
+	}
+	ret = (ret + (1 << 14)) >> 15;
+
+	return (unsigned char)std::max(std::min(ret, 255), 0);
+}
+
+
+// Span kernel for interior pixels, whose taps need no edge clamping.
+// Weight is float for the floating point kernels and short (Q0.15) for the fixed-point ones.
+template <typename Weight>
+using BlurSpanFunc = void (*)(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const Weight* weights);
+
+void blurSpan_scalar(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const float* weights)
+{
+	for (int i = 0; i < count; i++)
+	{
+		float ret[4] = { 0.f, 0.f, 0.f, 0.f };
+		const unsigned char* tap = src + 4 * i - KERNEL_RADIUS * tap_stride;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++, tap += tap_stride)
+		{
+			for (int channel = 0; channel < 4; channel++)
+			{
+				ret[channel] += weights[k] * tap[channel];
+			}
+		}
+
+		for (int channel = 0; channel < 4; channel++)
+		{
+			dst[4 * i + channel] = (unsigned char)std::max(std::min(ret[channel], 255.f), 0.f);
+		}
+	}
+}
+
+void blurSpanFixed_scalar(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const short* weights)
+{
+	for (int i = 0; i < count; i++)
+	{
+		int ret[4] = { 0, 0, 0, 0 };
+		const unsigned char* tap = src + 4 * i - KERNEL_RADIUS * tap_stride;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++, tap += tap_stride)
+		{
+			for (int channel = 0; channel < 4; channel++)
+			{
+				ret[channel] += weights[k] * tap[channel];
+			}
+		}
+
+		for (int channel = 0; channel < 4; channel++)
+		{
+			dst[4 * i + channel] = (unsigned char)std::max(std::min((ret[channel] + (1 << 14)) >> 15, 255), 0);
+		}
+	}
+}
+
+// Blurs all four channels of pixel (x, y) with the scalar blurAxis and writes them to dst
+template <typename Weight>
+void blurPixelScalar(int x, int y, int axis, unsigned char* input, unsigned char* dst, int width, int height, const Weight* weights)
+{
+	for (int channel = 0; channel < 4; channel++)
+	{
+		dst[channel] = blurAxis(x, y, channel, axis, input, width, height, weights);
+	}
+}
+
+// Blurs row y along the horizontal axis into output_row. Only the first and last KERNEL_RADIUS pixels need clamped taps.
+template <typename Weight>
+void blurRowHorizontal(BlurSpanFunc<Weight> blur_span, unsigned char* input, unsigned char* output_row, int y, int width, int height, const Weight* weights)
+{
+	int interior_begin = std::min(KERNEL_RADIUS, width);
+	int interior_end = std::max(width - KERNEL_RADIUS, interior_begin);
+
+	for (int x = 0; x < interior_begin; x++)
+	{
+		blurPixelScalar(x, y, 0, input, output_row + 4 * x, width, height, weights);
+	}
+	if (interior_end > interior_begin)
+	{
+		blur_span(input + 4 * (y * width + interior_begin), output_row + 4 * interior_begin, interior_end - interior_begin, 4, weights);
+	}
+	for (int x = interior_end; x < width; x++)
+	{
+		blurPixelScalar(x, y, 0, input, output_row + 4 * x, width, height, weights);
+	}
+}
+
+// Blurs columns x_begin to x_end - 1 of rows y_begin to y_end - 1 along the vertical axis,
+// walking down the image. The input rows of one output row overlap those of the next, so
+// they are still in L1 when reused, and every load reads a contiguous piece of a row.
+template <typename Weight>
+void blurStripVertical(BlurSpanFunc<Weight> blur_span, unsigned char* input, unsigned char* output, int x_begin, int x_end, int y_begin, int y_end, int width, int height, const Weight* weights)
+{
+	for (int y = y_begin; y < y_end; y++)
+	{
+		if (y >= KERNEL_RADIUS && y < height - KERNEL_RADIUS)
+		{
+			int pixel = y * width + x_begin;
+			blur_span(input + 4 * pixel, output + 4 * pixel, x_end - x_begin, 4 * (std::ptrdiff_t)width, weights);
+			continue;
+		}
+
+		for (int x = x_begin; x < x_end; x++)
+		{
+			blurPixelScalar(x, y, 1, input, output + 4 * (y * width + x), width, height, weights);
+		}
+	}
+}
+
+// Fused separable blur of output rows y_begin to y_end - 1. Horizontally blurred rows go
+// into a ring buffer of 2 * KERNEL_RADIUS + 1 rows, and each output row is blurred
+// vertically as soon as all of its input rows are in the ring, so the full-size
+// intermediate image is never materialized. The ring is indexed by virtual row: rows
+// above and below the image hold copies of the first and last row, which is exactly
+// the clamping of blurAxis, so every output row takes the span kernel. Each row is
+// stored twice, at slot and slot + ring_rows, so any window of 2 * KERNEL_RADIUS + 1
+// consecutive rows is contiguous in memory and read with a fixed row stride.
+// ring must hold 2 * (2 * KERNEL_RADIUS + 1) rows.
+template <typename Weight>
+void blurBandFused(BlurSpanFunc<Weight> blur_span, unsigned char* input, unsigned char* output, int y_begin, int y_end, int width, int height, const Weight* weights, unsigned char* ring)
+{
+	const int ring_rows = 2 * KERNEL_RADIUS + 1;
+	const std::size_t row_bytes = 4 * (std::size_t)width;
+
+	int next_row = y_begin - KERNEL_RADIUS;
+	for (int y = y_begin; y < y_end; y++)
+	{
+		// Fill the ring up to the last input row of output row y
+		for (; next_row <= y + KERNEL_RADIUS; next_row++)
+		{
+			int slot = (next_row + ring_rows * KERNEL_RADIUS) % ring_rows;
+			unsigned char* row = ring + slot * row_bytes;
+			int source_y = std::max(std::min(next_row, height - 1), 0);
+			int previous_source_y = std::max(std::min(next_row - 1, height - 1), 0);
+
+			if (next_row > y_begin - KERNEL_RADIUS && source_y == previous_source_y)
+			{
+				int previous_slot = (slot + ring_rows - 1) % ring_rows;
+				std::memcpy(row, ring + previous_slot * row_bytes, row_bytes);
+			}
+			else
+			{
+				blurRowHorizontal(blur_span, input, row, source_y, width, height, weights);
+			}
+			std::memcpy(row + ring_rows * row_bytes, row, row_bytes);
+		}
+
+		int first_slot = (y - KERNEL_RADIUS + ring_rows * KERNEL_RADIUS) % ring_rows;
+		unsigned char* center_row = ring + (first_slot + KERNEL_RADIUS) * row_bytes;
+		blur_span(center_row, output + 4 * (std::size_t)y * width, width, row_bytes, weights);
+	}
+}
+
+// Number of pixels in one column strip of the vertical pass
+inline int verticalStripPixels()
+{
+	return std::max(VERTICAL_STRIP_BYTES / 4, 1);
+}
+
+// Hand-vectorized span kernels. Every pixel is widened to four floats, so all four
+// channels are blurred with a single multiply-add per tap.
+#if defined(_MSC_VER)
+#define TARGET_SSE41
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+enum SimdLevel { SIMD_SCALAR, SIMD_SSE41, SIMD_AVX2, SIMD_AVX512 };
+
+TARGET_SSE41 inline void blurPixel_sse41(const unsigned char* src, unsigned char* dst, std::ptrdiff_t tap_stride, const float* weights)
+{
+	__m128 sum = _mm_setzero_ps();
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		int rgba;
+		std::memcpy(&rgba, src + (k - KERNEL_RADIUS) * tap_stride, 4);
+		__m128 pixel = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(rgba)));
+		sum = _mm_add_ps(sum, _mm_mul_ps(pixel, _mm_set1_ps(weights[k])));
+	}
+
+	__m128i result = _mm_cvttps_epi32(sum);
+	result = _mm_packus_epi32(result, result);
+	result = _mm_packus_epi16(result, result);
+	int rgba = _mm_cvtsi128_si32(result);
+	std::memcpy(dst, &rgba, 4);
+}
+
+TARGET_SSE41 void blurSpan_sse41(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const float* weights)
+{
+	for (int i = 0; i < count; i++)
+	{
+		blurPixel_sse41(src + 4 * i, dst + 4 * i, tap_stride, weights);
+	}
+}
+
+// 2 pixels per register, 2 registers per iteration
+TARGET_AVX2 void blurSpan_avx2(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const float* weights)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m256 sum0 = _mm256_setzero_ps();
+		__m256 sum1 = _mm256_setzero_ps();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			const unsigned char* tap = src + 4 * i + (k - KERNEL_RADIUS) * tap_stride;
+			__m128i pixels = _mm_loadu_si128((const __m128i*)tap);
+			__m256 weight = _mm256_set1_ps(weights[k]);
+			sum0 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(pixels)), weight, sum0);
+			sum1 = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(pixels, 8))), weight, sum1);
+		}
+
+		__m256i result0 = _mm256_cvttps_epi32(sum0);
+		__m256i result1 = _mm256_cvttps_epi32(sum1);
+		__m128i packed0 = _mm_packus_epi32(_mm256_castsi256_si128(result0), _mm256_extracti128_si256(result0, 1));
+		__m128i packed1 = _mm_packus_epi32(_mm256_castsi256_si128(result1), _mm256_extracti128_si256(result1, 1));
+		_mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_packus_epi16(packed0, packed1));
+	}
+
+	for (; i < count; i++)
+	{
+		blurPixel_sse41(src + 4 * i, dst + 4 * i, tap_stride, weights);
+	}
+}
+
+// 4 pixels per register
+TARGET_AVX512 void blurSpan_avx512(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const float* weights)
+{
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m512 sum = _mm512_setzero_ps();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			const unsigned char* tap = src + 4 * i + (k - KERNEL_RADIUS) * tap_stride;
+			__m512 pixels = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)tap)));
+			sum = _mm512_fmadd_ps(pixels, _mm512_set1_ps(weights[k]), sum);
+		}
+
+		_mm_storeu_si128((__m128i*)(dst + 4 * i), _mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(sum)));
+	}
+
+	for (; i < count; i++)
+	{
+		blurPixel_sse41(src + 4 * i, dst + 4 * i, tap_stride, weights);
+	}
+}
+
+// Fixed-point kernels. Pixels are widened to 16 bits and two taps are interleaved so that
+// one madd multiplies both by their Q0.15 weights and sums them into 32-bit lanes per channel.
+// With an odd tap count the last tap is paired with itself and a zero weight.
+inline int fixedWeightPair(const short* weights, int k)
+{
+	short weight_next = k + 1 < 2 * KERNEL_RADIUS + 1 ? weights[k + 1] : 0;
+	return (int)((unsigned int)(unsigned short)weight_next << 16 | (unsigned short)weights[k]);
+}
+
+// 2 pixels per iteration
+TARGET_SSE41 void blurSpanFixed_sse41(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const short* weights)
+{
+	const __m128i rounding = _mm_set1_epi32(1 << 14);
+	__m128i weight_pairs[KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k += 2)
+	{
+		weight_pairs[k / 2] = _mm_set1_epi32(fixedWeightPair(weights, k));
+	}
+
+	int i = 0;
+	for (; i < count; i += 2)
+	{
+		// the last pixel of an odd count is processed on its own
+		int pixels = std::min(count - i, 2);
+		__m128i sum0 = _mm_setzero_si128();
+		__m128i sum1 = _mm_setzero_si128();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k += 2)
+		{
+			int k_next = std::min(k + 1, 2 * KERNEL_RADIUS);
+			const unsigned char* tap = src + 4 * i + (k - KERNEL_RADIUS) * tap_stride;
+			const unsigned char* tap_next = src + 4 * i + (k_next - KERNEL_RADIUS) * tap_stride;
+
+			long long rgba2 = 0;
+			long long rgba2_next = 0;
+			std::memcpy(&rgba2, tap, 4 * pixels);
+			std::memcpy(&rgba2_next, tap_next, 4 * pixels);
+			__m128i a = _mm_cvtepu8_epi16(_mm_cvtsi64_si128(rgba2));
+			__m128i b = _mm_cvtepu8_epi16(_mm_cvtsi64_si128(rgba2_next));
+			sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weight_pairs[k / 2]));
+			sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weight_pairs[k / 2]));
+		}
+
+		sum0 = _mm_srai_epi32(_mm_add_epi32(sum0, rounding), 15);
+		sum1 = _mm_srai_epi32(_mm_add_epi32(sum1, rounding), 15);
+		__m128i result = _mm_packus_epi16(_mm_packus_epi32(sum0, sum1), _mm_setzero_si128());
+		long long rgba2 = _mm_cvtsi128_si64(result);
+		std::memcpy(dst + 4 * i, &rgba2, 4 * pixels);
+	}
+}
+
+// 4 pixels per iteration
+TARGET_AVX2 void blurSpanFixed_avx2(const unsigned char* src, unsigned char* dst, int count, std::ptrdiff_t tap_stride, const short* weights)
+{
+	const __m256i rounding = _mm256_set1_epi32(1 << 14);
+	__m256i weight_pairs[KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k += 2)
+	{
+		weight_pairs[k / 2] = _mm256_set1_epi32(fixedWeightPair(weights, k));
+	}
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		// Each 128-bit lane holds two pixels, so the low unpack yields pixels 0 and 2 and the high unpack pixels 1 and 3
+		__m256i sum_even = _mm256_setzero_si256();
+		__m256i sum_odd = _mm256_setzero_si256();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k += 2)
+		{
+			int k_next = std::min(k + 1, 2 * KERNEL_RADIUS);
+			const unsigned char* tap = src + 4 * i + (k - KERNEL_RADIUS) * tap_stride;
+			const unsigned char* tap_next = src + 4 * i + (k_next - KERNEL_RADIUS) * tap_stride;
+
+			__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)tap));
+			__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)tap_next));
+			sum_even = _mm256_add_epi32(sum_even, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weight_pairs[k / 2]));
+			sum_odd = _mm256_add_epi32(sum_odd, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weight_pairs[k / 2]));
+		}
+
+		sum_even = _mm256_srai_epi32(_mm256_add_epi32(sum_even, rounding), 15);
+		sum_odd = _mm256_srai_epi32(_mm256_add_epi32(sum_odd, rounding), 15);
+		// lane 0 holds pixels 0 and 1, lane 1 holds pixels 2 and 3
+		__m256i result = _mm256_packus_epi32(sum_even, sum_odd);
+		result = _mm256_packus_epi16(result, result);
+		result = _mm256_permute4x64_epi64(result, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)(dst + 4 * i), _mm256_castsi256_si128(result));
+	}
+
+	if (i < count)
+	{
+		blurSpanFixed_sse41(src + 4 * i, dst + 4 * i, count - i, tap_stride, weights);
+	}
+}
+
+SimdLevel detectSimdLevel()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool ymm_enabled = (xcr0 & 0x06) == 0x06;
+	bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;
+
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512 = (info[1] & (1 << 16)) != 0;
+
+	if (avx512 && avx2 && fma && zmm_enabled) return SIMD_AVX512;
+	if (avx2 && fma && ymm_enabled) return SIMD_AVX2;
+	if (sse41) return SIMD_SSE41;
+	return SIMD_SCALAR;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+	return SIMD_SCALAR;
+#endif
+}
+
+const SimdLevel simd_level = detectSimdLevel();
+
+const char* simdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_AVX512: return "AVX-512";
+	case SIMD_AVX2: return "AVX2";
+	case SIMD_SSE41: return "SSE4.1";
+	default: return "Scalar";
+	}
+}
+
+BlurSpanFunc<float> selectBlurSpan(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_AVX512: return blurSpan_avx512;
+	case SIMD_AVX2: return blurSpan_avx2;
+	case SIMD_SSE41: return blurSpan_sse41;
+	default: return blurSpan_scalar;
+	}
+}
+
+// The AVX2 integer kernel is also used on AVX-512 CPUs
+BlurSpanFunc<short> selectBlurSpanFixed(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_AVX512:
+	case SIMD_AVX2: return blurSpanFixed_avx2;
+	case SIMD_SSE41: return blurSpanFixed_sse41;
+	default: return blurSpanFixed_scalar;
+	}
+}
+
+// Planar (structure of arrays) image with one 8-bit plane per channel. The x = 0 sample of
+// every plane row is 64-byte aligned. A plane can carry `padding` extra samples left and right
+// of each row and `padding` extra rows above and below the image; padRowEdges and
+// padTopBottom fill them with copies of the edge samples, which is the clamping of blurAxis.
+// With padding >= KERNEL_RADIUS the span kernels blur every sample of a plane without any
+// border case: four consecutive samples of a plane take the place of the four channels of an
+// RGBA pixel, so the horizontal pass uses tap_stride = 1 and the vertical pass tap_stride = stride.
+// Rows are blurred in groups of 4 samples, so they are also padded up to a multiple of 4.
+class PlanarImage
+{
+public:
+	PlanarImage(int width, int height, int padding = 0)
+		: width(width), height(height), padding(padding), groups((width + 3) / 4)
+	{
+		left = (padding + 63) / 64 * 64;
+		stride = (left + 4 * groups + padding + 63) / 64 * 64;
+		std::size_t plane_bytes = (std::size_t)stride * (height + 2 * padding);
+		for (int plane = 0; plane < 4; plane++)
+		{
+			planes[plane] = (unsigned char*)_mm_malloc(plane_bytes, 64);
+		}
+	}
+
+	~PlanarImage()
+	{
+		for (int plane = 0; plane < 4; plane++)
+		{
+			_mm_free(planes[plane]);
+		}
+	}
+
+	PlanarImage(const PlanarImage&) = delete;
+	PlanarImage& operator=(const PlanarImage&) = delete;
+
+	unsigned char* row(int plane, int y)
+	{
+		return planes[plane] + (std::ptrdiff_t)(y + padding) * stride + left;
+	}
+
+	const unsigned char* row(int plane, int y) const
+	{
+		return planes[plane] + (std::ptrdiff_t)(y + padding) * stride + left;
+	}
+
+	// Copies the first and last sample of row y into its left and right padding
+	void padRowEdges(int plane, int y)
+	{
+		unsigned char* samples = row(plane, y);
+		std::memset(samples - padding, samples[0], padding);
+		std::memset(samples + width, samples[width - 1], 4 * groups + padding - width);
+	}
+
+	// Copies the first and last row, including their padding, into the rows above and below the image
+	void padTopBottom(int plane)
+	{
+		for (int p = 1; p <= padding; p++)
+		{
+			std::memcpy(row(plane, -p) - left, row(plane, 0) - left, stride);
+			std::memcpy(row(plane, height - 1 + p) - left, row(plane, height - 1) - left, stride);
+		}
+	}
+
+	int width;
+	int height;
+	int padding;
+	// Number of 4-sample groups per row
+	int groups;
+	std::ptrdiff_t stride;
+
+private:
+	int left;
+	unsigned char* planes[4];
+};
+
+void deinterleaveRow_scalar(const unsigned char* rgba, unsigned char* const planes[4], int x_begin, int x_end)
+{
+	for (int x = x_begin; x < x_end; x++)
+	{
+		for (int plane = 0; plane < 4; plane++)
+		{
+			planes[plane][x] = rgba[4 * x + plane];
+		}
+	}
+}
+
+void interleaveRow_scalar(const unsigned char* const planes[4], unsigned char* rgba, int x_begin, int x_end)
+{
+	for (int x = x_begin; x < x_end; x++)
+	{
+		for (int plane = 0; plane < 4; plane++)
+		{
+			rgba[4 * x + plane] = planes[plane][x];
+		}
+	}
+}
+
+// 16 pixels per iteration. The shuffle groups each channel of 4 pixels into one 32-bit lane,
+// then two rounds of unpacks gather the lanes of the same channel from the 4 registers.
+TARGET_SSE41 void deinterleaveRow_sse41(const unsigned char* rgba, unsigned char* const planes[4], int count)
+{
+	const __m128i by_channel = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	int x = 0;
+	for (; x + 16 <= count; x += 16)
+	{
+		__m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(rgba + 4 * x)), by_channel);
+		__m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(rgba + 4 * x + 16)), by_channel);
+		__m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(rgba + 4 * x + 32)), by_channel);
+		__m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(rgba + 4 * x + 48)), by_channel);
+
+		__m128i rg01 = _mm_unpacklo_epi32(p0, p1);
+		__m128i ba01 = _mm_unpackhi_epi32(p0, p1);
+		__m128i rg23 = _mm_unpacklo_epi32(p2, p3);
+		__m128i ba23 = _mm_unpackhi_epi32(p2, p3);
+
+		_mm_storeu_si128((__m128i*)(planes[0] + x), _mm_unpacklo_epi64(rg01, rg23));
+		_mm_storeu_si128((__m128i*)(planes[1] + x), _mm_unpackhi_epi64(rg01, rg23));
+		_mm_storeu_si128((__m128i*)(planes[2] + x), _mm_unpacklo_epi64(ba01, ba23));
+		_mm_storeu_si128((__m128i*)(planes[3] + x), _mm_unpackhi_epi64(ba01, ba23));
+	}
+	deinterleaveRow_scalar(rgba, planes, x, count);
+}
+
+// 16 pixels per iteration: byte unpacks pair R with G and B with A, 16-bit unpacks join the pairs into pixels
+TARGET_SSE41 void interleaveRow_sse41(const unsigned char* const planes[4], unsigned char* rgba, int count)
+{
+	int x = 0;
+	for (; x + 16 <= count; x += 16)
+	{
+		__m128i r = _mm_loadu_si128((const __m128i*)(planes[0] + x));
+		__m128i g = _mm_loadu_si128((const __m128i*)(planes[1] + x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(planes[2] + x));
+		__m128i a = _mm_loadu_si128((const __m128i*)(planes[3] + x));
+
+		__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+		__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+		__m128i ba_lo = _mm_unpacklo_epi8(b, a);
+		__m128i ba_hi = _mm_unpackhi_epi8(b, a);
+
+		_mm_storeu_si128((__m128i*)(rgba + 4 * x), _mm_unpacklo_epi16(rg_lo, ba_lo));
+		_mm_storeu_si128((__m128i*)(rgba + 4 * x + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+		_mm_storeu_si128((__m128i*)(rgba + 4 * x + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+		_mm_storeu_si128((__m128i*)(rgba + 4 * x + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+	}
+	interleaveRow_scalar(planes, rgba, x, count);
+}
+
+// Splits interleaved RGBA row y into the planes of image
+void deinterleaveRow(const unsigned char* rgba_row, PlanarImage& image, int y)
+{
+	unsigned char* const planes[4] = { image.row(0, y), image.row(1, y), image.row(2, y), image.row(3, y) };
+	if (simd_level >= SIMD_SSE41)
+	{
+		deinterleaveRow_sse41(rgba_row, planes, image.width);
+	}
+	else
+	{
+		deinterleaveRow_scalar(rgba_row, planes, 0, image.width);
+	}
+}
+
+// Joins the planes of row y of image into interleaved RGBA
+void interleaveRow(const PlanarImage& image, unsigned char* rgba_row, int y)
+{
+	const unsigned char* const planes[4] = { image.row(0, y), image.row(1, y), image.row(2, y), image.row(3, y) };
+	if (simd_level >= SIMD_SSE41)
+	{
+		interleaveRow_sse41(planes, rgba_row, image.width);
+	}
+	else
+	{
+		interleaveRow_scalar(planes, rgba_row, 0, image.width);
+	}
+}
+
+// Blurs row y of one plane horizontally. src needs padding >= KERNEL_RADIUS with padded row edges.
+template <typename Weight>
+void blurPlaneRowHorizontal(BlurSpanFunc<Weight> blur_span, const PlanarImage& src, PlanarImage& dst, int plane, int y, const Weight* weights)
+{
+	blur_span(src.row(plane, y), dst.row(plane, y), src.groups, 1, weights);
+}
+
+// Blurs row y of one plane vertically. src needs padding >= KERNEL_RADIUS with padded top and bottom rows.
+template <typename Weight>
+void blurPlaneRowVertical(BlurSpanFunc<Weight> blur_span, const PlanarImage& src, PlanarImage& dst, int plane, int y, const Weight* weights)
+{
+	blur_span(src.row(plane, y), dst.row(plane, y), src.groups, src.stride, weights);
+}
+
+// Channel masks have bit c set for channel c (R, G, B, A) of an image
+const unsigned ALL_CHANNELS = 0xF;
+
+int channelCount(unsigned channel_mask)
+{
+	int count = 0;
+	for (int channel = 0; channel < 4; channel++)
+	{
+		if (channel_mask & (1u << channel)) count++;
+	}
+	return count;
+}
+
+// Returns the mask of the channels that do not hold the same value in every pixel.
+// Images loaded with 4 requested channels from a file without alpha have a constant
+// alpha of 255, and a constant channel stays constant under a normalized blur, so its
+// plane can be skipped. The scan stops as soon as every channel is known to vary.
+unsigned varyingChannels(const unsigned char* rgba, int width, int height)
+{
+	int first_pixel;
+	std::memcpy(&first_pixel, rgba, 4);
+	__m128i first = _mm_set1_epi32(first_pixel);
+	unsigned mask = 0;
+	for (int y = 0; y < height && mask != ALL_CHANNELS; y++)
+	{
+		const unsigned char* row = rgba + 4 * (std::size_t)y * width;
+		__m128i differences = _mm_setzero_si128();
+		int x = 0;
+		for (; x + 4 <= width; x += 4)
+		{
+			differences = _mm_or_si128(differences, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(row + 4 * x)), first));
+		}
+
+		unsigned char lanes[16];
+		_mm_storeu_si128((__m128i*)lanes, differences);
+		for (int i = 0; i < 16; i++)
+		{
+			if (lanes[i] != 0) mask |= 1u << (i % 4);
+		}
+		for (; x < width; x++)
+		{
+			for (int channel = 0; channel < 4; channel++)
+			{
+				if (row[4 * x + channel] != rgba[channel]) mask |= 1u << channel;
+			}
+		}
+	}
+	return mask;
+}
+
+// Mask of the channels bloom has to blur. A channel that is 0 or 255 in every pixel composites
+// back to that same constant, so it is left out and its blurred mask is set to the constant too.
+unsigned bloomChannels(const unsigned char* rgba, int width, int height)
+{
+	unsigned mask = varyingChannels(rgba, width, height);
+	for (int channel = 0; channel < 4; channel++)
+	{
+		if (rgba[channel] != 0 && rgba[channel] != 255) mask |= 1u << channel;
+	}
+	return mask;
+}
+
+// dst = min(a + b, 255) for count bytes
+void addSaturatedRow(const unsigned char* a, const unsigned char* b, unsigned char* dst, int count)
+{
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i sum = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+		_mm_storeu_si128((__m128i*)(dst + i), sum);
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = (unsigned char)std::min(a[i] + b[i], 255);
+	}
+}
+
+// Table-driven sRGB transfer function for the linear-light bloom. Linear values are kept in
+// 12 bits (0 to LINEAR_MAX) where the image is composited, and in 8 bits for the bloom mask,
+// which only holds highlights where 8-bit linear steps are fine. Encoding indexes a table by
+// the 12-bit linear value, so no pow is evaluated per pixel.
+const int LINEAR_MAX = 4095;
+
+struct SrgbTables
+{
+	unsigned short to_linear[256];
+	unsigned char to_linear8[256];
+	unsigned char from_linear[LINEAR_MAX + 1];
+
+	SrgbTables()
+	{
+		for (int value = 0; value < 256; value++)
+		{
+			double linear = srgbToLinear(value / 255.0);
+			to_linear[value] = (unsigned short)std::lround(linear * LINEAR_MAX);
+			to_linear8[value] = (unsigned char)std::lround(linear * 255.0);
+		}
+		for (int linear = 0; linear <= LINEAR_MAX; linear++)
+		{
+			from_linear[linear] = (unsigned char)std::lround(linearToSrgb((double)linear / LINEAR_MAX) * 255.0);
+		}
+	}
+
+	static double srgbToLinear(double value)
+	{
+		return value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4);
+	}
+
+	static double linearToSrgb(double value)
+	{
+		return value <= 0.0031308 ? value * 12.92 : 1.055 * std::pow(value, 1.0 / 2.4) - 0.055;
+	}
+};
+
+const SrgbTables srgb_tables;
+
+// Rec.709 luminance weights in Q8: 0.2126, 0.7152 and 0.0722 rounded so that they sum to 256
+const int LUMA_WEIGHT_R = 54;
+const int LUMA_WEIGHT_G = 183;
+const int LUMA_WEIGHT_B = 19;
+
+void rec709LuminanceRow_scalar(const unsigned short* linear_rgba, unsigned short* luminance, int x_begin, int width)
+{
+	for (int x = x_begin; x < width; x++)
+	{
+		const unsigned short* pixel = linear_rgba + 4 * x;
+		luminance[x] = (unsigned short)((LUMA_WEIGHT_R * pixel[0] + LUMA_WEIGHT_G * pixel[1] + LUMA_WEIGHT_B * pixel[2]) >> 8);
+	}
+}
+
+// 4 pixels per iteration: madd gives R * wr + G * wg and B * wb + A * 0 per pixel, and hadd joins the halves
+TARGET_SSE41 void rec709LuminanceRow_sse41(const unsigned short* linear_rgba, unsigned short* luminance, int width)
+{
+	const __m128i luma_weights = _mm_setr_epi16(LUMA_WEIGHT_R, LUMA_WEIGHT_G, LUMA_WEIGHT_B, 0, LUMA_WEIGHT_R, LUMA_WEIGHT_G, LUMA_WEIGHT_B, 0);
+	int x = 0;
+	for (; x + 4 <= width; x += 4)
+	{
+		__m128i pixels01 = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(linear_rgba + 4 * x)), luma_weights);
+		__m128i pixels23 = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(linear_rgba + 4 * x + 8)), luma_weights);
+		__m128i luma = _mm_srli_epi32(_mm_hadd_epi32(pixels01, pixels23), 8);
+		_mm_storel_epi64((__m128i*)(luminance + x), _mm_packus_epi32(luma, luma));
+	}
+	rec709LuminanceRow_scalar(linear_rgba, luminance, x, width);
+}
+
+// Luminance of RGBA row rgba_row. In linear light the row is decoded into linear_row (4 * width
+// samples of scratch) and luminance is Rec.709 in 12-bit linear units; otherwise it is the
+// average of the gamma-encoded channels.
+void luminanceRow(const unsigned char* rgba_row, unsigned short* luminance, int width, bool linear_light, unsigned short* linear_row)
+{
+	if (!linear_light)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			luminance[x] = (unsigned short)((rgba_row[4 * x] + rgba_row[4 * x + 1] + rgba_row[4 * x + 2]) / 3);
+		}
+		return;
+	}
+
+	for (int i = 0; i < 4 * width; i++)
+	{
+		linear_row[i] = srgb_tables.to_linear[rgba_row[i]];
+	}
+	if (simd_level >= SIMD_SSE41)
+	{
+		rec709LuminanceRow_sse41(linear_row, luminance, width);
+	}
+	else
+	{
+		rec709LuminanceRow_scalar(linear_row, luminance, 0, width);
+	}
+}
+
+// Adds the 8-bit linear glow to the sRGB input in 12-bit linear light and encodes the sum back
+// to sRGB. Alpha is not gamma encoded and is added with saturation as in the gamma-space composite.
+void compositeLinearRow(const unsigned char* input, const unsigned char* glow, unsigned char* dst, int width)
+{
+	for (int x = 0; x < width; x++)
+	{
+		for (int channel = 0; channel < 3; channel++)
+		{
+			int linear = srgb_tables.to_linear[input[4 * x + channel]] + glow[4 * x + channel] * LINEAR_MAX / 255;
+			dst[4 * x + channel] = srgb_tables.from_linear[std::min(linear, LINEAR_MAX)];
+		}
+		dst[4 * x + 3] = (unsigned char)std::min(input[4 * x + 3] + glow[4 * x + 3], 255);
+	}
+}
+
+// Encodes the color channels of an 8-bit linear RGBA row to sRGB in place
+void encodeLinearRow(unsigned char* rgba, int width)
+{
+	for (int x = 0; x < width; x++)
+	{
+		for (int channel = 0; channel < 3; channel++)
+		{
+			rgba[4 * x + channel] = srgb_tables.from_linear[rgba[4 * x + channel] * LINEAR_MAX / 255];
+		}
+	}
+}
+
+// Blur used for the bloom mask: the separable Gaussian, or a dual-filter mip chain that
+// halves the mask BLOOM_MIP_LEVELS - 1 times and upsamples it back for a much wider glow
+enum BloomMode { BLOOM_GAUSSIAN, BLOOM_DUAL_FILTER };
+
+// One level of the dual-filter mip chain, as float planes
+struct MipLevel
+{
+	int width;
+	int height;
+	std::vector<float> planes[4];
+};
+
+// The dual filter samples bilinearly at fixed half-pixel offsets, so each of its passes
+// reduces to a constant 4x4 kernel per output pixel parity. The downsample takes the 2x2
+// block under the output pixel with weight 4 and the four diagonal 2x2 blocks one source
+// pixel away with weight 1, which is 1 on the outer ring and 5 on the inner 2x2, over 32.
+// Rows holds source rows 2y - 1 to 2y + 2, already clamped.
+template <typename Sample>
+void dualFilterDownsampleRow(const Sample* const rows[4], int src_width, float* dst_row, int dst_width)
+{
+	for (int x = 0; x < dst_width; x++)
+	{
+		int c0 = std::max(2 * x - 1, 0);
+		int c1 = std::min(2 * x, src_width - 1);
+		int c2 = std::min(2 * x + 1, src_width - 1);
+		int c3 = std::min(2 * x + 2, src_width - 1);
+		float ring = (float)rows[0][c0] + rows[0][c1] + rows[0][c2] + rows[0][c3]
+			+ rows[3][c0] + rows[3][c1] + rows[3][c2] + rows[3][c3]
+			+ rows[1][c0] + rows[1][c3] + rows[2][c0] + rows[2][c3];
+		float inner = (float)rows[1][c1] + rows[1][c2] + rows[2][c1] + rows[2][c2];
+		dst_row[x] = (ring + 5.f * inner) / 32.f;
+	}
+}
+
+// Adds a bilinear sample at position r, counted from the first of 4 taps, to taps
+inline void addBilinearTaps(float* taps, float r, float weight)
+{
+	int tap = (int)r;
+	float fraction = r - tap;
+	taps[tap] += weight * (1.f - fraction);
+	if (fraction > 0.f)
+	{
+		taps[tap + 1] += weight * fraction;
+	}
+}
+
+// 4x4 kernels of the dual-filter upsample, indexed [parity_y][parity_x][tap_y][tap_x].
+// Output pixel 2i + p sits at source position i - 0.25 + 0.5p and reads source pixels
+// i - 2 + p to i + 1 + p: four samples one source pixel away along the axes with weight 1
+// and four diagonal samples half a source pixel away with weight 2, over 12.
+struct DualFilterUpsampleKernels
+{
+	float weights[2][2][4][4];
+
+	DualFilterUpsampleKernels()
+	{
+		const float samples[8][3] = {
+			{ -1.f, 0.f, 1.f }, { 1.f, 0.f, 1.f }, { 0.f, -1.f, 1.f }, { 0.f, 1.f, 1.f },
+			{ -0.5f, -0.5f, 2.f }, { 0.5f, -0.5f, 2.f }, { -0.5f, 0.5f, 2.f }, { 0.5f, 0.5f, 2.f } };
+
+		std::memset(weights, 0, sizeof(weights));
+		for (int parity_y = 0; parity_y < 2; parity_y++)
+		{
+			for (int parity_x = 0; parity_x < 2; parity_x++)
+			{
+				for (const float* sample : samples)
+				{
+					float taps_x[4] = { 0.f, 0.f, 0.f, 0.f };
+					float taps_y[4] = { 0.f, 0.f, 0.f, 0.f };
+					addBilinearTaps(taps_x, 1.75f - 0.5f * parity_x + sample[0], 1.f);
+					addBilinearTaps(taps_y, 1.75f - 0.5f * parity_y + sample[1], 1.f);
+					for (int tap_y = 0; tap_y < 4; tap_y++)
+					{
+						for (int tap_x = 0; tap_x < 4; tap_x++)
+						{
+							weights[parity_y][parity_x][tap_y][tap_x] += sample[2] / 12.f * taps_y[tap_y] * taps_x[tap_x];
+						}
+					}
+				}
+			}
+		}
+	}
+};
+
+const DualFilterUpsampleKernels dual_filter_upsample;
+
+// Dual-filter upsample of row y of one channel into dst_row, for a level twice the size of src
+void dualFilterUpsampleRow(const MipLevel& src, int dst_width, int y, int channel, float* dst_row)
+{
+	const float* plane = src.planes[channel].data();
+	int parity_y = y & 1;
+	const float* rows[4];
+	for (int tap_y = 0; tap_y < 4; tap_y++)
+	{
+		int source_y = std::max(std::min(y / 2 - 2 + parity_y + tap_y, src.height - 1), 0);
+		rows[tap_y] = plane + (std::size_t)source_y * src.width;
+	}
+
+	for (int x = 0; x < dst_width; x++)
+	{
+		int parity_x = x & 1;
+		int first = x / 2 - 2 + parity_x;
+		const float (*kernel)[4] = dual_filter_upsample.weights[parity_y][parity_x];
+		float sum = 0.f;
+		for (int tap_x = 0; tap_x < 4; tap_x++)
+		{
+			int source_x = std::max(std::min(first + tap_x, src.width - 1), 0);
+			sum += kernel[0][tap_x] * rows[0][source_x] + kernel[1][tap_x] * rows[1][source_x]
+				+ kernel[2][tap_x] * rows[2][source_x] + kernel[3][tap_x] * rows[3][source_x];
+		}
+		dst_row[x] = sum;
+	}
+}
+
+
+
+// Coefficients of the Young - van Vliet recursive Gaussian, divided by b0. Each sample is
+// B * input + b1 * previous + b2 * second previous + b3 * third previous, so the cost per
+// pixel does not depend on sigma. Valid for sigma >= 0.5. M is the Triggs - Sdika matrix that
+// starts the anti-causal pass as if the signal continued with its last value forever.
+struct RecursiveGaussian
+{
+	float B;
+	float b1;
+	float b2;
+	float b3;
+	float M[3][3];
+};
+
+RecursiveGaussian youngVanVlietCoefficients(float sigma)
+{
+	double q = sigma >= 2.5f ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1.0 - 0.26891 * sigma);
+	double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+	double a1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+	double a2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+	double a3 = 0.422205 * q * q * q / b0;
+
+	RecursiveGaussian coefficients;
+	coefficients.b1 = (float)a1;
+	coefficients.b2 = (float)a2;
+	coefficients.b3 = (float)a3;
+	coefficients.B = (float)(1.0 - (a1 + a2 + a3));
+
+	double c = 1.0 / ((1.0 + a1 - a2 + a3) * (1.0 + a2 + (a1 - a3) * a3));
+	coefficients.M[0][0] = (float)(c * (-a3 * (a1 + a3) - a2 + 1.0));
+	coefficients.M[0][1] = (float)(c * (a3 + a1) * (a2 + a3 * a1));
+	coefficients.M[0][2] = (float)(c * a3 * (a1 + a3 * a2));
+	coefficients.M[1][0] = (float)(c * (a1 + a3 * a2));
+	coefficients.M[1][1] = (float)(c * -(a2 - 1.0) * (a2 + a3 * a1));
+	coefficients.M[1][2] = (float)(c * -(a3 * a1 + a3 * a3 + a2 - 1.0) * a3);
+	coefficients.M[2][0] = (float)(c * (a3 * a1 + a2 + a1 * a1 - a2 * a2));
+	coefficients.M[2][1] = (float)(c * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3));
+	coefficients.M[2][2] = (float)(c * a3 * (a1 + a3 * a2));
+	return coefficients;
+}
+
+// Runs the causal and then the anti-causal filter in place along a line of samples. Sample n
+// is the lanes floats starting at data + n * step; all lanes are filtered independently, so a
+// horizontal line has the 4 channels of a pixel as lanes and a vertical line a whole strip of
+// pixels. The signal is extended with its first and last sample, which matches the
+// clamp-to-edge border of blurAxis. history must hold 4 * lanes floats.
+void recursiveGaussianLine(float* data, int samples, std::ptrdiff_t step, int lanes, const RecursiveGaussian& c, float* history)
+{
+	float* last_input = history + 3 * lanes;
+	std::memcpy(last_input, data + (samples - 1) * step, lanes * sizeof(float));
+
+	// Causal pass, starting from the steady state of a constant signal equal to the first sample
+	std::memcpy(history, data, lanes * sizeof(float));
+	for (int n = 0; n < samples; n++)
+	{
+		float* x = data + n * step;
+		const float* w1 = n >= 1 ? x - step : history;
+		const float* w2 = n >= 2 ? x - 2 * step : history;
+		const float* w3 = n >= 3 ? x - 3 * step : history;
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			x[lane] = c.B * x[lane] + c.b1 * w1[lane] + c.b2 * w2[lane] + c.b3 * w3[lane];
+		}
+	}
+
+	// Anti-causal outputs just past the end of the line, history[i * lanes] for sample samples + i
+	for (int lane = 0; lane < lanes; lane++)
+	{
+		float u[3];
+		for (int k = 0; k < 3; k++)
+		{
+			int n = std::max(samples - 1 - k, 0);
+			u[k] = data[n * step + lane] - last_input[lane];
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			history[i * lanes + lane] = c.M[i][0] * u[0] + c.M[i][1] * u[1] + c.M[i][2] * u[2] + last_input[lane];
+		}
+	}
+
+	for (int n = samples - 1; n >= 0; n--)
+	{
+		float* x = data + n * step;
+		const float* w1 = n + 1 < samples ? x + step : history + (n + 1 - samples) * lanes;
+		const float* w2 = n + 2 < samples ? x + 2 * step : history + (n + 2 - samples) * lanes;
+		const float* w3 = n + 3 < samples ? x + 3 * step : history + (n + 3 - samples) * lanes;
+		for (int lane = 0; lane < lanes; lane++)
+		{
+			x[lane] = c.B * x[lane] + c.b1 * w1[lane] + c.b2 * w2[lane] + c.b3 * w3[lane];
+		}
+	}
+}
+
+// Radii of passes box blurs whose combined variance is as close as possible to a Gaussian of
+// the given sigma: the widths are the two odd numbers around the ideal width sqrt(12 sigma^2 / passes + 1)
+std::vector<int> boxRadiiForGaussian(float sigma, int passes)
+{
+	double ideal_width = std::sqrt(12.0 * sigma * sigma / passes + 1.0);
+	int lower_width = (int)std::floor(ideal_width);
+	if (lower_width % 2 == 0) lower_width--;
+	lower_width = std::max(lower_width, 1);
+	int lower_passes = (int)std::lround((12.0 * sigma * sigma - passes * lower_width * lower_width - 4.0 * passes * lower_width - 3.0 * passes) / (-4.0 * lower_width - 4.0));
+
+	std::vector<int> radii(passes);
+	for (int i = 0; i < passes; i++)
+	{
+		int box_width = i < lower_passes ? lower_width : lower_width + 2;
+		radii[i] = box_width / 2;
+	}
+	return radii;
+}
+
+// Worst-case difference in intensity levels between the 2D blur made of the given box passes and
+// the exact KERNEL_RADIUS Gaussian, i.e. 255 times half the L1 distance between the two kernels.
+// It holds away from the borders: within the sum of the radii of an edge, every pass clamps to
+// the edge on its own, which is not the same as clamping once for the combined kernel.
+double boxApproximationError(const std::vector<int>& radii, float sigma)
+{
+	// 1D kernel of the box passes, as the convolution of the individual boxes
+	std::vector<double> box(1, 1.0);
+	for (int radius : radii)
+	{
+		std::vector<double> next(box.size() + 2 * radius, 0.0);
+		for (std::size_t i = 0; i < box.size(); i++)
+		{
+			for (int k = 0; k < 2 * radius + 1; k++)
+			{
+				next[i + k] += box[i] / (2 * radius + 1);
+			}
+		}
+		box = next;
+	}
+
+	int box_radius = (int)box.size() / 2;
+	int support = std::max(box_radius, KERNEL_RADIUS);
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+	std::vector<double> box_padded(2 * support + 1, 0.0);
+	std::vector<double> gauss_padded(2 * support + 1, 0.0);
+	for (int offset = -box_radius; offset <= box_radius; offset++)
+	{
+		box_padded[offset + support] = box[offset + box_radius];
+	}
+	for (int offset = -KERNEL_RADIUS; offset <= KERNEL_RADIUS; offset++)
+	{
+		gauss_padded[offset + support] = weights[offset + KERNEL_RADIUS];
+	}
+
+	double distance = 0.0;
+	for (int i = 0; i < 2 * support + 1; i++)
+	{
+		for (int j = 0; j < 2 * support + 1; j++)
+		{
+			distance += std::abs(box_padded[i] * box_padded[j] - gauss_padded[i] * gauss_padded[j]);
+		}
+	}
+	return 255.0 * distance / 2.0;
+}
+
+// The box passes carry their samples with BOX_FRACTION_BITS fraction bits (255 << 7 = 32640
+// fits a 16-bit lane), so the image is rounded to 8 bits only once, by the last pass. Window
+// sums are exact integers far below 2^24, so they also convert to float exactly before they
+// are scaled; the first pass reads 8-bit samples and the last one writes them directly.
+const int BOX_FRACTION_BITS = 7;
+
+// Worst-case rounding error in intensity levels of passes box blurs per axis: each of the
+// 2 * passes - 1 intermediate passes rounds by half a fraction step, which later passes never
+// amplify since a box has unit gain, and the last pass rounds to 8 bits
+double boxRoundingError(int passes)
+{
+	return 0.5 + (2 * passes - 1) * 0.5 / (1 << BOX_FRACTION_BITS);
+}
+
+// Box blur of the given radius along a row of RGBA pixels: dst gets round(scale * window sum)
+// per channel, with the row extended by its edge pixels like the clamped blurAxis. The vector
+// kernels build prefix sums of the row in prefix, which must hold 4 * (width + 2 * radius + 4) ints.
+template <typename Sample>
+using BoxRowFunc = void (*)(const Sample* src, unsigned short* dst, int width, int radius, float scale, int* prefix);
+
+// One step of a vertical box pass over lanes consecutive samples of a row: writes
+// round(scale * sums) to the output row, then slides the window down by one row.
+template <typename Sample>
+using BoxStepFunc = void (*)(const unsigned short* entering, const unsigned short* leaving, int* sums, Sample* out, int lanes, float scale);
+
+template <typename Sample>
+void boxBlurRow_scalar(const Sample* src, unsigned short* dst, int width, int radius, float scale, int* /*prefix*/)
+{
+	int sums[4] = { 0, 0, 0, 0 };
+	for (int k = -radius; k <= radius; k++)
+	{
+		const Sample* pixel = src + 4 * std::max(std::min(k, width - 1), 0);
+		for (int channel = 0; channel < 4; channel++)
+		{
+			sums[channel] += pixel[channel];
+		}
+	}
+
+	for (int x = 0; x < width; x++)
+	{
+		const Sample* entering = src + 4 * std::min(x + radius + 1, width - 1);
+		const Sample* leaving = src + 4 * std::max(x - radius, 0);
+		for (int channel = 0; channel < 4; channel++)
+		{
+			dst[4 * x + channel] = (unsigned short)(sums[channel] * scale + 0.5f);
+			sums[channel] += entering[channel] - leaving[channel];
+		}
+	}
+}
+
+template <typename Sample>
+void boxBlurStep_scalar(const unsigned short* entering, const unsigned short* leaving, int* sums, Sample* out, int lanes, float scale)
+{
+	for (int i = 0; i < lanes; i++)
+	{
+		out[i] = (Sample)(sums[i] * scale + 0.5f);
+		sums[i] += entering[i] - leaving[i];
+	}
+}
+
+// Loads and stores of 1, 2 or 4 pixels of 8 or 16-bit samples as 32-bit lanes
+TARGET_SSE41 inline __m128i loadBoxPixel(const unsigned char* src)
+{
+	int rgba;
+	std::memcpy(&rgba, src, 4);
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(rgba));
+}
+
+TARGET_SSE41 inline __m128i loadBoxPixel(const unsigned short* src)
+{
+	return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)src));
+}
+
+TARGET_AVX2 inline __m256i loadBoxPixels2(const unsigned char* src)
+{
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src));
+}
+
+TARGET_AVX2 inline __m256i loadBoxPixels2(const unsigned short* src)
+{
+	return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)src));
+}
+
+TARGET_AVX512 inline __m512i loadBoxPixels4(const unsigned char* src)
+{
+	return _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)src));
+}
+
+TARGET_AVX512 inline __m512i loadBoxPixels4(const unsigned short* src)
+{
+	return _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)src));
+}
+
+TARGET_SSE41 inline void storeBoxResult(__m128i result, unsigned short* dst)
+{
+	_mm_storel_epi64((__m128i*)dst, _mm_packus_epi32(result, result));
+}
+
+TARGET_SSE41 inline void storeBoxResult(__m128i result, unsigned char* dst)
+{
+	result = _mm_packus_epi32(result, result);
+	int rgba = _mm_cvtsi128_si32(_mm_packus_epi16(result, result));
+	std::memcpy(dst, &rgba, 4);
+}
+
+TARGET_AVX2 inline void storeBoxResult(__m256i result, unsigned short* dst)
+{
+	_mm_storeu_si128((__m128i*)dst, _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1)));
+}
+
+TARGET_AVX2 inline void storeBoxResult(__m256i result, unsigned char* dst)
+{
+	__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+	_mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(packed, packed));
+}
+
+TARGET_AVX512 inline void storeBoxResult(__m512i result, unsigned short* dst)
+{
+	_mm256_storeu_si256((__m256i*)dst, _mm512_cvtusepi32_epi16(result));
+}
+
+TARGET_AVX512 inline void storeBoxResult(__m512i result, unsigned char* dst)
+{
+	_mm_storeu_si128((__m128i*)dst, _mm512_cvtusepi32_epi8(result));
+}
+
+// The four channel sums of a pixel in one register
+template <typename Sample>
+TARGET_SSE41 void boxBlurRow_sse41(const Sample* src, unsigned short* dst, int width, int radius, float scale, int* /*prefix*/)
+{
+	const __m128 scale4 = _mm_set1_ps(scale);
+	const __m128 half = _mm_set1_ps(0.5f);
+
+	__m128i sums = _mm_setzero_si128();
+	for (int k = -radius; k <= radius; k++)
+	{
+		sums = _mm_add_epi32(sums, loadBoxPixel(src + 4 * std::max(std::min(k, width - 1), 0)));
+	}
+
+	for (int x = 0; x < width; x++)
+	{
+		storeBoxResult(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sums), scale4), half)), dst + 4 * x);
+
+		__m128i entering = loadBoxPixel(src + 4 * std::min(x + radius + 1, width - 1));
+		__m128i leaving = loadBoxPixel(src + 4 * std::max(x - radius, 0));
+		sums = _mm_add_epi32(sums, _mm_sub_epi32(entering, leaving));
+	}
+}
+
+// The wider kernels turn the serial running sum into prefix sums of the extended row
+// E[t] = src[clamp(t - radius)], P[0] = 0 and P[t + 1] = P[t] + E[t], so that the window sum
+// of pixel x is P[x + 2 * radius + 1] - P[x]. Several pixels of P are computed per register
+// with an in-register scan, and the window sums are then independent. P wraps around for very
+// long rows, but the differences, which are below 2^31, are still exact.
+// Appends to prefix the prefix sums of count pixels taken step samples apart, from a step of
+// 0 for copies of an edge pixel to 4 for consecutive pixels, and returns the new total
+template <typename Sample>
+TARGET_SSE41 __m128i boxPrefixAppend(const Sample* pixels, int count, int step, __m128i total, int* prefix)
+{
+	for (int i = 0; i < count; i++)
+	{
+		total = _mm_add_epi32(total, loadBoxPixel(pixels + i * step));
+		_mm_storeu_si128((__m128i*)(prefix + 4 * i), total);
+	}
+	return total;
+}
+
+TARGET_SSE41 inline void boxWindowPixel(const int* prefix, int window, __m128 scale4, unsigned short* dst)
+{
+	__m128i sum = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(prefix + 4 * window)), _mm_loadu_si128((const __m128i*)prefix));
+	storeBoxResult(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale4), _mm_set1_ps(0.5f))), dst);
+}
+
+// 2 pixels per register
+template <typename Sample>
+TARGET_AVX2 void boxBlurRow_avx2(const Sample* src, unsigned short* dst, int width, int radius, float scale, int* prefix)
+{
+	const int window = 2 * radius + 1;
+
+	__m128i total = _mm_setzero_si128();
+	_mm_storeu_si128((__m128i*)prefix, total);
+	total = boxPrefixAppend(src, radius, 0, total, prefix + 4);
+
+	int x = 0;
+	int* p = prefix + 4 * (radius + 1);
+	__m256i carry = _mm256_broadcastsi128_si256(total);
+	for (; x + 2 <= width; x += 2)
+	{
+		__m256i pixels = loadBoxPixels2(src + 4 * x);
+		pixels = _mm256_add_epi32(pixels, _mm256_permute2x128_si256(pixels, pixels, 0x08));
+		pixels = _mm256_add_epi32(pixels, carry);
+		_mm256_storeu_si256((__m256i*)(p + 4 * x), pixels);
+		carry = _mm256_permute2x128_si256(pixels, pixels, 0x11);
+	}
+	total = _mm256_castsi256_si128(carry);
+	total = boxPrefixAppend(src + 4 * x, width - x, 4, total, p + 4 * x);
+	boxPrefixAppend(src + 4 * (width - 1), radius, 0, total, p + 4 * width);
+
+	const __m256 scale8 = _mm256_set1_ps(scale);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	x = 0;
+	for (; x + 2 <= width; x += 2)
+	{
+		__m256i sum = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(prefix + 4 * (x + window))), _mm256_loadu_si256((const __m256i*)(prefix + 4 * x)));
+		storeBoxResult(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale8), half)), dst + 4 * x);
+	}
+	for (; x < width; x++)
+	{
+		boxWindowPixel(prefix + 4 * x, window, _mm_set1_ps(scale), dst + 4 * x);
+	}
+}
+
+// 4 pixels per register. The scan adds the register shifted up by one and then by two pixels.
+template <typename Sample>
+TARGET_AVX512 void boxBlurRow_avx512(const Sample* src, unsigned short* dst, int width, int radius, float scale, int* prefix)
+{
+	const int window = 2 * radius + 1;
+	const __m512i zero = _mm512_setzero_si512();
+
+	__m128i total = _mm_setzero_si128();
+	_mm_storeu_si128((__m128i*)prefix, total);
+	total = boxPrefixAppend(src, radius, 0, total, prefix + 4);
+
+	int x = 0;
+	int* p = prefix + 4 * (radius + 1);
+	__m512i carry = _mm512_broadcast_i32x4(total);
+	for (; x + 4 <= width; x += 4)
+	{
+		__m512i pixels = loadBoxPixels4(src + 4 * x);
+		pixels = _mm512_add_epi32(pixels, _mm512_alignr_epi32(pixels, zero, 12));
+		pixels = _mm512_add_epi32(pixels, _mm512_alignr_epi32(pixels, zero, 8));
+		pixels = _mm512_add_epi32(pixels, carry);
+		_mm512_storeu_si512((void*)(p + 4 * x), pixels);
+		carry = _mm512_shuffle_i32x4(pixels, pixels, 0xFF);
+	}
+	total = _mm512_castsi512_si128(carry);
+	total = boxPrefixAppend(src + 4 * x, width - x, 4, total, p + 4 * x);
+	boxPrefixAppend(src + 4 * (width - 1), radius, 0, total, p + 4 * width);
+
+	const __m512 scale16 = _mm512_set1_ps(scale);
+	const __m512 half = _mm512_set1_ps(0.5f);
+	x = 0;
+	for (; x + 4 <= width; x += 4)
+	{
+		__m512i sum = _mm512_sub_epi32(_mm512_loadu_si512((const void*)(prefix + 4 * (x + window))), _mm512_loadu_si512((const void*)(prefix + 4 * x)));
+		storeBoxResult(_mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(sum), scale16), half)), dst + 4 * x);
+	}
+	for (; x < width; x++)
+	{
+		boxWindowPixel(prefix + 4 * x, window, _mm_set1_ps(scale), dst + 4 * x);
+	}
+}
+
+// 4 lanes per iteration
+template <typename Sample>
+TARGET_SSE41 void boxBlurStep_sse41(const unsigned short* entering, const unsigned short* leaving, int* sums, Sample* out, int lanes, float scale)
+{
+	const __m128 scale4 = _mm_set1_ps(scale);
+	const __m128 half = _mm_set1_ps(0.5f);
+	int i = 0;
+	for (; i + 4 <= lanes; i += 4)
+	{
+		__m128i sum = _mm_loadu_si128((const __m128i*)(sums + i));
+		storeBoxResult(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale4), half)), out + i);
+		sum = _mm_add_epi32(sum, _mm_sub_epi32(loadBoxPixel(entering + i), loadBoxPixel(leaving + i)));
+		_mm_storeu_si128((__m128i*)(sums + i), sum);
+	}
+	boxBlurStep_scalar(entering + i, leaving + i, sums + i, out + i, lanes - i, scale);
+}
+
+// 8 lanes per iteration
+template <typename Sample>
+TARGET_AVX2 void boxBlurStep_avx2(const unsigned short* entering, const unsigned short* leaving, int* sums, Sample* out, int lanes, float scale)
+{
+	const __m256 scale8 = _mm256_set1_ps(scale);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	int i = 0;
+	for (; i + 8 <= lanes; i += 8)
+	{
+		__m256i sum = _mm256_loadu_si256((const __m256i*)(sums + i));
+		storeBoxResult(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale8), half)), out + i);
+		sum = _mm256_add_epi32(sum, _mm256_sub_epi32(loadBoxPixels2(entering + i), loadBoxPixels2(leaving + i)));
+		_mm256_storeu_si256((__m256i*)(sums + i), sum);
+	}
+	boxBlurStep_sse41(entering + i, leaving + i, sums + i, out + i, lanes - i, scale);
+}
+
+// 16 lanes per iteration
+template <typename Sample>
+TARGET_AVX512 void boxBlurStep_avx512(const unsigned short* entering, const unsigned short* leaving, int* sums, Sample* out, int lanes, float scale)
+{
+	const __m512 scale16 = _mm512_set1_ps(scale);
+	const __m512 half = _mm512_set1_ps(0.5f);
+	int i = 0;
+	for (; i + 16 <= lanes; i += 16)
+	{
+		__m512i sum = _mm512_loadu_si512((const void*)(sums + i));
+		storeBoxResult(_mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(sum), scale16), half)), out + i);
+		sum = _mm512_add_epi32(sum, _mm512_sub_epi32(loadBoxPixels4(entering + i), loadBoxPixels4(leaving + i)));
+		_mm512_storeu_si512((void*)(sums + i), sum);
+	}
+	boxBlurStep_avx2(entering + i, leaving + i, sums + i, out + i, lanes - i, scale);
+}
+
+template <typename Sample>
+BoxRowFunc<Sample> selectBoxRow(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_AVX512: return boxBlurRow_avx512<Sample>;
+	case SIMD_AVX2: return boxBlurRow_avx2<Sample>;
+	case SIMD_SSE41: return boxBlurRow_sse41<Sample>;
+	default: return boxBlurRow_scalar<Sample>;
+	}
+}
+
+template <typename Sample>
+BoxStepFunc<Sample> selectBoxStep(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_AVX512: return boxBlurStep_avx512<Sample>;
+	case SIMD_AVX2: return boxBlurStep_avx2<Sample>;
+	case SIMD_SSE41: return boxBlurStep_sse41<Sample>;
+	default: return boxBlurStep_scalar<Sample>;
+	}
+}
+
+// Vertical box pass over a column block of lanes samples per row and height rows. Row y of the
+// input starts at input + y * input_stride and row y of the output at output + y * output_stride.
+// sums must hold lanes ints.
+template <typename Sample>
+void boxBlurColumns(BoxStepFunc<Sample> box_step, const unsigned short* input, std::ptrdiff_t input_stride, Sample* output, std::ptrdiff_t output_stride, int lanes, int height, int radius, float scale, int* sums)
+{
+	for (int i = 0; i < lanes; i++)
+	{
+		sums[i] = 0;
+	}
+	for (int k = -radius; k <= radius; k++)
+	{
+		const unsigned short* row = input + std::max(std::min(k, height - 1), 0) * input_stride;
+		for (int i = 0; i < lanes; i++)
+		{
+			sums[i] += row[i];
+		}
+	}
+
+	for (int y = 0; y < height; y++)
+	{
+		const unsigned short* entering = input + std::min(y + radius + 1, height - 1) * input_stride;
+		const unsigned short* leaving = input + std::max(y - radius, 0) * input_stride;
+		box_step(entering, leaving, sums, output + y * output_stride, lanes, scale);
+	}
+}
+
+// Fixed-point blur with a 16-bit intermediate. The horizontal pass keeps 7 fraction bits
+// (U8.7, at most 255 * 128 = 32640, so it still fits a signed 16-bit lane) instead of rounding
+// to 8 bits, and the vertical pass reads it directly with the same madd pairing as the 8-bit
+// kernels, so the image is rounded only once. Both passes take an array of tap pointers:
+// dst[i] is the weighted sum of taps[k][i] over the 2 * KERNEL_RADIUS + 1 taps, counted in samples.
+const int INTERMEDIATE_FRACTION_BITS = 7;
+
+void blurTapsToFixed16_scalar(const unsigned char* const* taps, short* dst, int count, const short* weights)
+{
+	const int shift = 15 - INTERMEDIATE_FRACTION_BITS;
+	for (int i = 0; i < count; i++)
+	{
+		int sum = 0;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			sum += weights[k] * taps[k][i];
+		}
+		dst[i] = (short)((sum + (1 << (shift - 1))) >> shift);
+	}
+}
+
+void blurTapsFromFixed16_scalar(const short* const* taps, unsigned char* dst, int count, const short* weights)
+{
+	const int shift = 15 + INTERMEDIATE_FRACTION_BITS;
+	for (int i = 0; i < count; i++)
+	{
+		int sum = 0;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			sum += weights[k] * taps[k][i];
+		}
+		dst[i] = (unsigned char)std::max(std::min((sum + (1 << (shift - 1))) >> shift, 255), 0);
+	}
+}
+
+// 16 samples per iteration. The unpacks split each 128-bit lane, so the low sums hold samples
+// 0-3 and 8-11 and the high sums samples 4-7 and 12-15, which a lane-wise pack puts back in order.
+TARGET_AVX2 void blurTapsToFixed16_avx2(const unsigned char* const* taps, short* dst, int count, const short* weights)
+{
+	const int shift = 15 - INTERMEDIATE_FRACTION_BITS;
+	const __m256i rounding = _mm256_set1_epi32(1 << (shift - 1));
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i sum_low = _mm256_setzero_si256();
+		__m256i sum_high = _mm256_setzero_si256();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k += 2)
+		{
+			int k_next = std::min(k + 1, 2 * KERNEL_RADIUS);
+			__m256i weight_pair = _mm256_set1_epi32(fixedWeightPair(weights, k));
+			__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(taps[k] + i)));
+			__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(taps[k_next] + i)));
+			sum_low = _mm256_add_epi32(sum_low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weight_pair));
+			sum_high = _mm256_add_epi32(sum_high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weight_pair));
+		}
+
+		sum_low = _mm256_srai_epi32(_mm256_add_epi32(sum_low, rounding), shift);
+		sum_high = _mm256_srai_epi32(_mm256_add_epi32(sum_high, rounding), shift);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_packs_epi32(sum_low, sum_high));
+	}
+
+	const unsigned char* tail_taps[2 * KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		tail_taps[k] = taps[k] + i;
+	}
+	blurTapsToFixed16_scalar(tail_taps, dst + i, count - i, weights);
+}
+
+// 16 samples per iteration, ordered as in blurTapsToFixed16_avx2; the final pack to bytes
+// leaves 8 samples per lane, which the permute joins in the low half
+TARGET_AVX2 void blurTapsFromFixed16_avx2(const short* const* taps, unsigned char* dst, int count, const short* weights)
+{
+	const int shift = 15 + INTERMEDIATE_FRACTION_BITS;
+	const __m256i rounding = _mm256_set1_epi32(1 << (shift - 1));
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i sum_low = _mm256_setzero_si256();
+		__m256i sum_high = _mm256_setzero_si256();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k += 2)
+		{
+			int k_next = std::min(k + 1, 2 * KERNEL_RADIUS);
+			__m256i weight_pair = _mm256_set1_epi32(fixedWeightPair(weights, k));
+			__m256i a = _mm256_loadu_si256((const __m256i*)(taps[k] + i));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(taps[k_next] + i));
+			sum_low = _mm256_add_epi32(sum_low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), weight_pair));
+			sum_high = _mm256_add_epi32(sum_high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), weight_pair));
+		}
+
+		sum_low = _mm256_srai_epi32(_mm256_add_epi32(sum_low, rounding), shift);
+		sum_high = _mm256_srai_epi32(_mm256_add_epi32(sum_high, rounding), shift);
+		__m256i result = _mm256_packs_epi32(sum_low, sum_high);
+		result = _mm256_packus_epi16(result, result);
+		result = _mm256_permute4x64_epi64(result, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(result));
+	}
+
+	const short* tail_taps[2 * KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		tail_taps[k] = taps[k] + i;
+	}
+	blurTapsFromFixed16_scalar(tail_taps, dst + i, count - i, weights);
+}
+
+// Blurs RGBA row y horizontally into the 16-bit output_row. padded_row holds width + 2 * KERNEL_RADIUS
+// pixels of scratch, where the row is copied with its edge pixels repeated on both sides.
+void blurRowHorizontalToFixed16(const unsigned char* input, short* output_row, int y, int width, const short* weights, unsigned char* padded_row)
+{
+	const unsigned char* row = input + 4 * (std::size_t)y * width;
+	for (int x = -KERNEL_RADIUS; x < width + KERNEL_RADIUS; x++)
+	{
+		std::memcpy(padded_row + 4 * (x + KERNEL_RADIUS), row + 4 * std::max(std::min(x, width - 1), 0), 4);
+	}
+
+	const unsigned char* taps[2 * KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		taps[k] = padded_row + 4 * k;
+	}
+	if (simd_level >= SIMD_AVX2)
+	{
+		blurTapsToFixed16_avx2(taps, output_row, 4 * width, weights);
+	}
+	else
+	{
+		blurTapsToFixed16_scalar(taps, output_row, 4 * width, weights);
+	}
+}
+
+// Blurs row y of the 16-bit intermediate vertically into the RGBA output_row, reading clamped rows
+void blurRowVerticalFromFixed16(const short* input, unsigned char* output_row, int y, int width, int height, const short* weights)
+{
+	const short* taps[2 * KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		taps[k] = input + 4 * (std::size_t)std::max(std::min(y + k - KERNEL_RADIUS, height - 1), 0) * width;
+	}
+	if (simd_level >= SIMD_AVX2)
+	{
+		blurTapsFromFixed16_avx2(taps, output_row, 4 * width, weights);
+	}
+	else
+	{
+		blurTapsFromFixed16_scalar(taps, output_row, 4 * width, weights);
+	}
+}
+
+// Float (HDR) pipeline. Images are loaded once as linear float RGBA with stbi_loadf, which
+// reads .hdr files as they are and linearizes 8-bit files with a 2.2 gamma, so every pass
+// works on unclamped floats and only the final tone mapping quantizes back to 8 bits.
+float* loadImageFloat(const char* filename, int* width, int* height)
+{
+	int img_orig_channels = 4;
+	return stbi_loadf(filename, width, height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+}
+
+// dst[i] = sum over k of weights[k] * taps[k][i], for count floats. taps[k] points to the
+// samples of tap k, so rows of clamped row pointers and offsets into a padded row both work.
+void blurTapsFloat_scalar(const float* const* taps, float* dst, int count, const float* weights)
+{
+	for (int i = 0; i < count; i++)
+	{
+		float sum = 0.f;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			sum += weights[k] * taps[k][i];
+		}
+		dst[i] = sum;
+	}
+}
+
+// 8 floats (2 RGBA pixels) per iteration
+TARGET_AVX2 void blurTapsFloat_avx2(const float* const* taps, float* dst, int count, const float* weights)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 sum = _mm256_setzero_ps();
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			sum = _mm256_fmadd_ps(_mm256_loadu_ps(taps[k] + i), _mm256_set1_ps(weights[k]), sum);
+		}
+		_mm256_storeu_ps(dst + i, sum);
+	}
+
+	for (; i < count; i++)
+	{
+		float sum = 0.f;
+		for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+		{
+			sum += weights[k] * taps[k][i];
+		}
+		dst[i] = sum;
+	}
+}
+
+void blurTapsFloat(const float* const* taps, float* dst, int count, const float* weights)
+{
+	if (simd_level >= SIMD_AVX2)
+	{
+		blurTapsFloat_avx2(taps, dst, count, weights);
+	}
+	else
+	{
+		blurTapsFloat_scalar(taps, dst, count, weights);
+	}
+}
+
+// Blurs float RGBA row y horizontally into output_row. padded_row holds width + 2 * KERNEL_RADIUS
+// pixels of scratch, where the row is copied with its edge pixels repeated on both sides.
+void blurRowHorizontalFloat(const float* input, float* output_row, int y, int width, const float* weights, float* padded_row)
+{
+	const float* row = input + 4 * (std::size_t)y * width;
+	for (int x = -KERNEL_RADIUS; x < width + KERNEL_RADIUS; x++)
+	{
+		std::memcpy(padded_row + 4 * (x + KERNEL_RADIUS), row + 4 * std::max(std::min(x, width - 1), 0), 4 * sizeof(float));
+	}
+
+	const float* taps[2 * KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		taps[k] = padded_row + 4 * k;
+	}
+	blurTapsFloat(taps, output_row, 4 * width, weights);
+}
+
+// Blurs float RGBA row y vertically into output_row, reading clamped rows of input
+void blurRowVerticalFloat(const float* input, float* output_row, int y, int width, int height, const float* weights)
+{
+	const float* taps[2 * KERNEL_RADIUS + 1];
+	for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+	{
+		taps[k] = input + 4 * (std::size_t)std::max(std::min(y + k - KERNEL_RADIUS, height - 1), 0) * width;
+	}
+	blurTapsFloat(taps, output_row, 4 * width, weights);
+}
+
+// Extended Reinhard tone mapping of the color channels with the given white point, followed by
+// the 2.2 display gamma and rounding to 8 bits. With white = 1 it leaves values in [0, 1] unchanged,
+// so LDR inputs come back as they went in. Alpha is only clamped.
+void toneMapRow(const float* hdr, unsigned char* ldr, int width, float white)
+{
+	float inverse_white_squared = 1.f / (white * white);
+	for (int x = 0; x < width; x++)
+	{
+		for (int channel = 0; channel < 3; channel++)
+		{
+			float value = std::max(hdr[4 * x + channel], 0.f);
+			float mapped = value * (1.f + value * inverse_white_squared) / (1.f + value);
+			ldr[4 * x + channel] = (unsigned char)(std::min(std::pow(mapped, 1.f / 2.2f), 1.f) * 255.f + 0.5f);
+		}
+		ldr[4 * x + 3] = (unsigned char)(std::max(std::min(hdr[4 * x + 3], 1.f), 0.f) * 255.f + 0.5f);
+	}
+}
+
+// Largest color channel value of the image, at least 1, used as the tone mapping white point
+float whitePoint(const float* hdr, int width, int height)
+{
+	float white = 1.f;
+	#pragma omp parallel
+	{
+		int pixel;
+		float local_white = 1.f;
+		#pragma omp for
+		for (pixel = 0; pixel < width * height; pixel++)
+		{
+			local_white = std::max(local_white, std::max(hdr[4 * pixel], std::max(hdr[4 * pixel + 1], hdr[4 * pixel + 2])));
+		}
+
+		#pragma omp critical
+		{
+			white = std::max(white, local_white);
+		}
+	}
+	return white;
+}
+
+void gaussian_blur_separate_serial(const char* filename)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Horizontal Blur
+	for (int y = 0; y < height; y++)
+	{
+		blurRowHorizontal(blurSpan_scalar, img_in, img_horizontal_blur + 4 * y * width, y, width, height, weights);
+	}
+	// Vertical Blur in column strips
+	int strip_pixels = verticalStripPixels();
+	for (int x_begin = 0; x_begin < width; x_begin += strip_pixels)
+	{
+		blurStripVertical(blurSpan_scalar, img_horizontal_blur, img_out, x_begin, std::min(x_begin + strip_pixels, width), 0, height, width, height, weights);
+	}
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Separate - Serial: Time %dms\n", time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_separate.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_horizontal_blur;
+	delete[] img_out;
+}
+
+// Gaussian blur with the recursive filter: same cost for any sigma, so it is meant for the large
+// sigmas that the KERNEL_RADIUS convolution cannot reach. The horizontal pass is parallel over
+// rows and the vertical pass over narrow column blocks. The image is kept in floats between the passes.
+void gaussian_blur_recursive(const char* filename, float blur_sigma)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	float* img_float = new float[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	RecursiveGaussian coefficients = youngVanVlietCoefficients(blur_sigma);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Horizontal Blur
+	int y;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (y = 0; y < height; y++)
+	{
+		float history[16];
+		float* row = img_float + 4 * y * width;
+		for (int i = 0; i < 4 * width; i++)
+		{
+			row[i] = img_in[4 * y * width + i];
+		}
+		recursiveGaussianLine(row, width, 4, 4, coefficients, history);
+	}
+
+	// Vertical Blur in column blocks
+	int blocks = (width + COLUMN_BLOCK_PIXELS - 1) / COLUMN_BLOCK_PIXELS;
+	int block;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (block = 0; block < blocks; block++)
+	{
+		int x_begin = block * COLUMN_BLOCK_PIXELS;
+		int lanes = 4 * (std::min(x_begin + COLUMN_BLOCK_PIXELS, width) - x_begin);
+		float* history = new float[4 * lanes];
+		recursiveGaussianLine(img_float + 4 * x_begin, height, 4 * (std::ptrdiff_t)width, lanes, coefficients, history);
+		delete[] history;
+
+		for (int y = 0; y < height; y++)
+		{
+			for (int lane = 0; lane < lanes; lane++)
+			{
+				int i = 4 * (y * width + x_begin) + lane;
+				img_out[i] = (unsigned char)std::max(std::min(img_float[i], 255.f), 0.f);
+			}
+		}
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Recursive (sigma %.1f): Time %dms\n", blur_sigma, time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_recursive.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_float;
+	delete[] img_out;
+}
+
+void gaussian_blur_separate_parallel(const char* filename)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Horizontal Blur
+	int y;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (y = 0; y < height; y++)
+	{
+		blurRowHorizontal(blurSpan_scalar, img_in, img_horizontal_blur + 4 * y * width, y, width, height, weights);
+	}
+
+	// Vertical Blur in column strips, cut into row bands so that there are enough work items
+	int strip_pixels = verticalStripPixels();
+	int strips = (width + strip_pixels - 1) / strip_pixels;
+	int bands = (height + VERTICAL_BAND_ROWS - 1) / VERTICAL_BAND_ROWS;
+	int tile;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (tile = 0; tile < strips * bands; tile++)
+	{
+		int x_begin = (tile % strips) * strip_pixels;
+		int y_begin = (tile / strips) * VERTICAL_BAND_ROWS;
+		blurStripVertical(blurSpan_scalar, img_horizontal_blur, img_out, x_begin, std::min(x_begin + strip_pixels, width), y_begin, std::min(y_begin + VERTICAL_BAND_ROWS, height), width, height, weights);
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Separate - Parallel: Time %dms\n", time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_image_parallel.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_horizontal_blur;
+	delete[] img_out;
+}
+
+// Approximates the Gaussian blur with passes box blurs per axis. Each box pass costs O(1) per pixel
+// whatever its radius, at the price of a small error against the exact kernel which is reported.
+// The passes keep BOX_FRACTION_BITS fraction bits between them and run the dispatched box kernels.
+void gaussian_blur_box_parallel(const char* filename, int passes)
+{
+	if (passes < 1)
+	{
+		printf("Box Blur needs at least one pass, got %d\n", passes);
+		return;
+	}
+
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned short* img_horizontal_blur = new unsigned short[(std::size_t)width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	std::vector<int> radii = boxRadiiForGaussian(sigma, passes);
+	// boxRadiiForGaussian returns the radii in increasing order
+	int max_radius = radii.back();
+	const float fraction_scale = (float)(1 << BOX_FRACTION_BITS);
+	// Vector kernels for the widest instruction set this CPU supports
+	BoxRowFunc<unsigned char> box_row_first = selectBoxRow<unsigned char>(simd_level);
+	BoxRowFunc<unsigned short> box_row = selectBoxRow<unsigned short>(simd_level);
+	BoxStepFunc<unsigned short> box_step = selectBoxStep<unsigned short>(simd_level);
+	BoxStepFunc<unsigned char> box_step_last = selectBoxStep<unsigned char>(simd_level);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	#pragma omp parallel
+	{
+		// Horizontal Blur, all passes of a row run in two row-sized buffers. The first pass reads
+		// the 8-bit input and scales it to the fixed-point samples.
+		int y, pass;
+		unsigned short* row_buffers[2] = { new unsigned short[width * 4], new unsigned short[width * 4] };
+		int* prefix = new int[4 * (width + 2 * max_radius + 4)];
+		#pragma omp for schedule(dynamic, 1) private(pass)
+		for (y = 0; y < height; y++)
+		{
+			for (pass = 0; pass < passes; pass++)
+			{
+				unsigned short* row_out = pass == passes - 1 ? img_horizontal_blur + 4 * (std::size_t)y * width : row_buffers[pass % 2];
+				float scale = 1.f / (2 * radii[pass] + 1);
+				if (pass == 0)
+				{
+					box_row_first(img_in + 4 * (std::size_t)y * width, row_out, width, radii[pass], scale * fraction_scale, prefix);
+				}
+				else
+				{
+					box_row(row_buffers[(pass - 1) % 2], row_out, width, radii[pass], scale, prefix);
+				}
+			}
+		}
+		delete[] row_buffers[0];
+		delete[] row_buffers[1];
+		delete[] prefix;
+	}
+
+	// Vertical Blur in column blocks. All passes of a block run back to back in two block-sized
+	// buffers that stay in cache, and only the last one writes the image.
+	int blocks = (width + COLUMN_BLOCK_PIXELS - 1) / COLUMN_BLOCK_PIXELS;
+	#pragma omp parallel
+	{
+		int block, pass;
+		const int block_lanes = 4 * COLUMN_BLOCK_PIXELS;
+		unsigned short* column_buffers[2] = { new unsigned short[(std::size_t)block_lanes * height], new unsigned short[(std::size_t)block_lanes * height] };
+		int sums[4 * COLUMN_BLOCK_PIXELS];
+		#pragma omp for schedule(dynamic, 1) private(pass)
+		for (block = 0; block < blocks; block++)
+		{
+			int x_begin = block * COLUMN_BLOCK_PIXELS;
+			int lanes = 4 * (std::min(x_begin + COLUMN_BLOCK_PIXELS, width) - x_begin);
+			const unsigned short* column_in = img_horizontal_blur + 4 * x_begin;
+			std::ptrdiff_t in_stride = 4 * (std::ptrdiff_t)width;
+			for (pass = 0; pass < passes; pass++)
+			{
+				float scale = 1.f / (2 * radii[pass] + 1);
+				if (pass == passes - 1)
+				{
+					boxBlurColumns(box_step_last, column_in, in_stride, img_out + 4 * x_begin, 4 * (std::ptrdiff_t)width, lanes, height, radii[pass], scale / fraction_scale, sums);
+					break;
+				}
+				unsigned short* column_out = column_buffers[pass % 2];
+				boxBlurColumns(box_step, column_in, in_stride, column_out, block_lanes, lanes, height, radii[pass], scale, sums);
+				column_in = column_out;
+				in_stride = block_lanes;
+			}
+		}
+		delete[] column_buffers[0];
+		delete[] column_buffers[1];
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Box Blur - Parallel (%d passes, %s): Time %dms, max interior error vs Gaussian %.1f levels\n", passes, simdLevelName(simd_level), time, boxApproximationError(radii, sigma) + boxRoundingError(passes));
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_box.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_horizontal_blur;
+	delete[] img_out;
+}
+
+void gaussian_blur_separate_simd(const char* filename)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+	// Vector kernels for the widest instruction set this CPU supports
+	BlurSpanFunc<float> blur_span = selectBlurSpan(simd_level);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Horizontal Blur
+	int y;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (y = 0; y < height; y++)
+	{
+		blurRowHorizontal(blur_span, img_in, img_horizontal_blur + 4 * y * width, y, width, height, weights);
+	}
+
+	// Vertical Blur in column strips, cut into row bands so that there are enough work items
+	int strip_pixels = verticalStripPixels();
+	int strips = (width + strip_pixels - 1) / strip_pixels;
+	int bands = (height + VERTICAL_BAND_ROWS - 1) / VERTICAL_BAND_ROWS;
+	int tile;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (tile = 0; tile < strips * bands; tile++)
+	{
+		int x_begin = (tile % strips) * strip_pixels;
+		int y_begin = (tile / strips) * VERTICAL_BAND_ROWS;
+		blurStripVertical(blur_span, img_horizontal_blur, img_out, x_begin, std::min(x_begin + strip_pixels, width), y_begin, std::min(y_begin + VERTICAL_BAND_ROWS, height), width, height, weights);
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Separate - SIMD (%s): Time %dms\n", simdLevelName(simd_level), time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_simd.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_horizontal_blur;
+	delete[] img_out;
+}
+
+// With skip_constant_channels, channels that hold the same value in every pixel are detected
+// after loading and copied to the output instead of being blurred
+void gaussian_blur_separate_planar(const char* filename, bool skip_constant_channels)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Padded planes, so both passes read their taps without clamping
+	PlanarImage planar_in(width, height, KERNEL_RADIUS);
+	PlanarImage planar_horizontal_blur(width, height, KERNEL_RADIUS);
+	PlanarImage planar_out(width, height);
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+	// Vector kernels for the widest instruction set this CPU supports
+	BlurSpanFunc<float> blur_span = selectBlurSpan(simd_level);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	unsigned channel_mask = skip_constant_channels ? varyingChannels(img_in, width, height) : ALL_CHANNELS;
+
+	#pragma omp parallel
+	{
+		int y, plane;
+
+		// Split the channels into planes
+		#pragma omp for schedule(dynamic, 1) private(plane)
+		for (y = 0; y < height; y++)
+		{
+			deinterleaveRow(img_in + 4 * y * width, planar_in, y);
+			for (plane = 0; plane < 4; plane++)
+			{
+				planar_in.padRowEdges(plane, y);
+			}
+		}
+
+		// Horizontal Blur
+		#pragma omp for schedule(dynamic, 1) private(plane)
+		for (y = 0; y < height; y++)
+		{
+			for (plane = 0; plane < 4; plane++)
+			{
+				if (channel_mask & (1u << plane))
+				{
+					blurPlaneRowHorizontal(blur_span, planar_in, planar_horizontal_blur, plane, y, weights);
+				}
+			}
+		}
+
+		#pragma omp for
+		for (plane = 0; plane < 4; plane++)
+		{
+			if (channel_mask & (1u << plane))
+			{
+				planar_horizontal_blur.padTopBottom(plane);
+			}
+		}
+
+		// Vertical Blur, interleaving each finished row back into RGBA
+		#pragma omp for schedule(dynamic, 1) private(plane)
+		for (y = 0; y < height; y++)
+		{
+			for (plane = 0; plane < 4; plane++)
+			{
+				if (channel_mask & (1u << plane))
+				{
+					blurPlaneRowVertical(blur_span, planar_horizontal_blur, planar_out, plane, y, weights);
+				}
+				else
+				{
+					std::memset(planar_out.row(plane, y), img_in[plane], width);
+				}
+			}
+			interleaveRow(planar_out, img_out + 4 * y * width, y);
+		}
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Separate - Planar (%s, %d channels): Time %dms\n", simdLevelName(simd_level), channelCount(channel_mask), time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_planar.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_out;
+}
+
+void gaussian_blur_separate_fixed(const char* filename)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Q0.15 blur weights, cached across calls
+	const short* weights = GaussianKernelBank::getFixed(sigma, KERNEL_RADIUS);
+	// Integer vector kernels for the widest instruction set this CPU supports
+	BlurSpanFunc<short> blur_span = selectBlurSpanFixed(simd_level);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Horizontal Blur
+	int y;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (y = 0; y < height; y++)
+	{
+		blurRowHorizontal(blur_span, img_in, img_horizontal_blur + 4 * y * width, y, width, height, weights);
+	}
+
+	// Vertical Blur in column strips, cut into row bands so that there are enough work items
+	int strip_pixels = verticalStripPixels();
+	int strips = (width + strip_pixels - 1) / strip_pixels;
+	int bands = (height + VERTICAL_BAND_ROWS - 1) / VERTICAL_BAND_ROWS;
+	int tile;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (tile = 0; tile < strips * bands; tile++)
+	{
+		int x_begin = (tile % strips) * strip_pixels;
+		int y_begin = (tile / strips) * VERTICAL_BAND_ROWS;
+		blurStripVertical(blur_span, img_horizontal_blur, img_out, x_begin, std::min(x_begin + strip_pixels, width), y_begin, std::min(y_begin + VERTICAL_BAND_ROWS, height), width, height, weights);
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Separate - Fixed point (%s): Time %dms\n", simdLevelName(std::min(simd_level, SIMD_AVX2)), time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_fixed.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_horizontal_blur;
+	delete[] img_out;
+}
+
+// Fixed-point blur that keeps the horizontal result in 16 bits, so each pixel is rounded once
+void gaussian_blur_separate_fixed16(const char* filename)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	short* img_horizontal_blur = new short[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Q0.15 blur weights, cached across calls
+	const short* weights = GaussianKernelBank::getFixed(sigma, KERNEL_RADIUS);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	#pragma omp parallel
+	{
+		std::vector<unsigned char> padded_row(4 * ((std::size_t)width + 2 * KERNEL_RADIUS));
+		int y;
+
+		// Horizontal Blur into the U8.7 intermediate
+		#pragma omp for schedule(dynamic, 1)
+		for (y = 0; y < height; y++)
+		{
+			blurRowHorizontalToFixed16(img_in, img_horizontal_blur + 4 * (std::size_t)y * width, y, width, weights, padded_row.data());
+		}
+
+		// Vertical Blur back to 8 bits
+		#pragma omp for schedule(dynamic, 1)
+		for (y = 0; y < height; y++)
+		{
+			blurRowVerticalFromFixed16(img_horizontal_blur, img_out + 4 * (std::size_t)y * width, y, width, height, weights);
+		}
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	// The 16-bit intermediate kernels have an AVX2 and a scalar variant only
+	printf("Gaussian Blur Separate - Fixed point, 16-bit intermediate (%s): Time %dms\n", simdLevelName(simd_level >= SIMD_AVX2 ? SIMD_AVX2 : SIMD_SCALAR), time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_fixed16.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_horizontal_blur;
+	delete[] img_out;
+}
+
+void gaussian_blur_separate_fused(const char* filename)
+{
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_out = new unsigned char[width * height * 4];
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+	// Vector kernels for the widest instruction set this CPU supports
+	BlurSpanFunc<float> blur_span = selectBlurSpan(simd_level);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// One band of rows per thread, so only the 2 * KERNEL_RADIUS rows around each band boundary are blurred horizontally twice
+	int bands = std::min(omp_get_max_threads(), height);
+	int band;
+	#pragma omp parallel for schedule(static, 1)
+	for (band = 0; band < bands; band++)
+	{
+		unsigned char* ring = new unsigned char[2 * (2 * KERNEL_RADIUS + 1) * width * 4];
+		blurBandFused(blur_span, img_in, img_out, band * height / bands, (band + 1) * height / bands, width, height, weights, ring);
+		delete[] ring;
+	}
+
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Gaussian Blur Separate - Fused (%s): Time %dms\n", simdLevelName(simd_level), time);
+
+	// Write the blurred image into a JPG file
+	stbi_write_jpg("images/blurred_fused.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+
+	stbi_image_free(img_in);
+	delete[] img_out;
+}
+
+// With skip_constant_channels, channels left out by bloomChannels are not masked or blurred.
+// The Gaussian blur is sparse: thresholding marks the tiles that hold a bright pixel, and only
+// tiles next to a marked one are blurred. Everywhere else the blurred mask is zero and the input
+// is copied straight to the output. The dual-filter mode blurs the whole mip chain.
+// With linear_light, the input is decoded from sRGB through lookup tables: the threshold uses
+// Rec.709 luminance, the mask is blurred as linear light and the glow is added in linear light
+// before the result is encoded back to sRGB.
+void bloom_parallel(const char* filename, BloomMode mode, bool skip_constant_channels, bool linear_light)
+{
+
+	int width = 0;
+	int height = 0;
+	int img_orig_channels = 4;
+	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
+	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	if (img_in == nullptr)
+	{
+		printf("Could not load %s\n", filename);
+		return;
+	}
+
+	unsigned char* img_final = new unsigned char[width * height * 4];
+	unsigned char* blurred_mask = new unsigned char[width * height * 4];
+	// The mask is blurred in padded planes, so both passes read their taps without clamping
+	PlanarImage bloom_mask(width, height, KERNEL_RADIUS);
+	PlanarImage planar_horizontal_blur(width, height, KERNEL_RADIUS);
+	PlanarImage planar_blurred_mask(width, height);
+	unsigned short* luminance = new unsigned short[width * height];
+	unsigned short max_luminance = 0;
+
+	// Tile occupancy map and the tiles each blur pass has to process, only used by the sparse Gaussian blur
+	bool sparse = mode == BLOOM_GAUSSIAN;
+	int tiles_x = (width + BLOOM_TILE_SIZE - 1) / BLOOM_TILE_SIZE;
+	int tiles_y = (height + BLOOM_TILE_SIZE - 1) / BLOOM_TILE_SIZE;
+	std::vector<unsigned char> occupied(sparse ? tiles_x * tiles_y : 0, 0);
+	std::vector<unsigned char> horizontal_active(sparse ? tiles_x * tiles_y : 0, 0);
+	std::vector<unsigned char> vertical_active(sparse ? tiles_x * tiles_y : 0, 0);
+	int active_tiles = 0;
+
+	// Dual-filter mip chain below full resolution: mip_chain[0] is half the size of the image
+	std::vector<MipLevel> mip_chain;
+	if (mode == BLOOM_DUAL_FILTER)
+	{
+		int level_width = width;
+		int level_height = height;
+		for (int level = 1; level < BLOOM_MIP_LEVELS; level++)
+		{
+			level_width = (level_width + 1) / 2;
+			level_height = (level_height + 1) / 2;
+			mip_chain.push_back({ level_width, level_height, {} });
+			for (int channel = 0; channel < 4; channel++)
+			{
+				mip_chain.back().planes[channel].resize((std::size_t)level_width * level_height);
+			}
+		}
+	}
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
+	// Timer to measure performance
+	auto start = std::chrono::high_resolution_clock::now();
+
+	unsigned channel_mask = skip_constant_channels ? bloomChannels(img_in, width, height) : ALL_CHANNELS;
+
+	#pragma omp parallel
+	{
+		// calculate max luminance of all pixels
+		int y, x, pixel, channel;
+		unsigned short local_max_luminance = 0;
+		std::vector<unsigned short> linear_row(linear_light ? 4 * (std::size_t)width : 0);
+		#pragma omp for schedule(dynamic, 1) private(x, pixel)
+		for (y = 0; y < height; y++)
+		{
+			luminanceRow(img_in + 4 * (std::size_t)y * width, luminance + (std::size_t)y * width, width, linear_light, linear_row.data());
+			for (x = 0; x < width; x++)
+			{
+				pixel = y * width + x;
+				if (luminance[pixel] > local_max_luminance) {
+					local_max_luminance = luminance[pixel];
+				}
+			}
+		}
+
+		#pragma omp critical
+		{
+			if (local_max_luminance > max_luminance) {
+				max_luminance = local_max_luminance;
+			}
+		}
+		// The threshold needs the maximum of every thread
+		#pragma omp barrier
+
+		// create bloom_mask planes, one row of tiles per iteration so each occupancy flag has a single writer
+		int tile_y, tile_x;
+		#pragma omp for schedule(dynamic, 1) private(y, x, pixel, channel)
+		for (tile_y = 0; tile_y < tiles_y; tile_y++)
+		{
+			for (y = tile_y * BLOOM_TILE_SIZE; y < std::min((tile_y + 1) * BLOOM_TILE_SIZE, height); y++)
+			{
+				for (x = 0; x < width; x++)
+				{
+					pixel = y * width + x;
+					bool bright = luminance[pixel] > 0.9f * max_luminance;
+					if (bright && sparse)
+					{
+						occupied[tile_y * tiles_x + x / BLOOM_TILE_SIZE] = 1;
+					}
+					for (channel = 0; channel < 4; channel++)
+					{
+						if (channel_mask & (1u << channel))
+						{
+							unsigned char value = img_in[4 * pixel + channel];
+							if (linear_light && channel < 3)
+							{
+								value = srgb_tables.to_linear8[value];
+							}
+							bloom_mask.row(channel, y)[x] = bright ? value : 0;
+						}
+					}
+				}
+				for (channel = 0; channel < 4; channel++)
+				{
+					if (channel_mask & (1u << channel))
+					{
+						bloom_mask.padRowEdges(channel, y);
+					}
+				}
+			}
+		}
+
+		// A horizontally blurred tile can only be non-zero next to an occupied tile in the same tile row,
+		// a fully blurred tile next to an occupied tile in any direction
+		if (sparse)
+		{
+			#pragma omp for schedule(dynamic, 1) private(tile_x) reduction(+:active_tiles)
+			for (tile_y = 0; tile_y < tiles_y; tile_y++)
+			{
+				for (tile_x = 0; tile_x < tiles_x; tile_x++)
+				{
+					for (int dy = -1; dy <= 1; dy++)
+					{
+						for (int dx = -1; dx <= 1; dx++)
+						{
+							int neighbor_x = tile_x + dx;
+							int neighbor_y = tile_y + dy;
+							if (neighbor_x < 0 || neighbor_x >= tiles_x || neighbor_y < 0 || neighbor_y >= tiles_y || !occupied[neighbor_y * tiles_x + neighbor_x])
+							{
+								continue;
+							}
+							vertical_active[tile_y * tiles_x + tile_x] = 1;
+							if (dy == 0)
+							{
+								horizontal_active[tile_y * tiles_x + tile_x] = 1;
+							}
+						}
+					}
+					active_tiles += vertical_active[tile_y * tiles_x + tile_x];
+				}
+			}
+		}
+
+		if (mode == BLOOM_DUAL_FILTER)
+		{
+			std::vector<float> upsampled_row(width);
+			int level = 0;
+
+			// The first level is downsampled straight from the 8-bit mask planes
+			#pragma omp for schedule(dynamic, 1) private(channel)
+			for (y = 0; y < mip_chain[0].height; y++)
+			{
+				for (channel = 0; channel < 4; channel++)
+				{
+					if (channel_mask & (1u << channel))
+					{
+						const unsigned char* rows[4];
+						for (int tap_y = 0; tap_y < 4; tap_y++)
+						{
+							rows[tap_y] = bloom_mask.row(channel, std::max(std::min(2 * y - 1 + tap_y, height - 1), 0));
+						}
+						dualFilterDownsampleRow(rows, width, mip_chain[0].planes[channel].data() + (std::size_t)y * mip_chain[0].width, mip_chain[0].width);
+					}
+				}
+			}
+
+			for (level = 1; level < (int)mip_chain.size(); level++)
+			{
+				const MipLevel& src = mip_chain[level - 1];
+				MipLevel& dst = mip_chain[level];
+				#pragma omp for schedule(dynamic, 1) private(channel)
+				for (y = 0; y < dst.height; y++)
+				{
+					for (channel = 0; channel < 4; channel++)
+					{
+						if (channel_mask & (1u << channel))
+						{
+							const float* rows[4];
+							for (int tap_y = 0; tap_y < 4; tap_y++)
+							{
+								rows[tap_y] = src.planes[channel].data() + (std::size_t)std::max(std::min(2 * y - 1 + tap_y, src.height - 1), 0) * src.width;
+							}
+							dualFilterDownsampleRow(rows, src.width, dst.planes[channel].data() + (std::size_t)y * dst.width, dst.width);
+						}
+					}
+				}
+			}
 
-unsigned char blurAxis(int x, int y, int channel, int axis/*0: horizontal axis, 1: vertical axis*/, unsigned char* input, int width, int height)
-{
-	float sum_weight = 0.0f;
-	float ret = 0.f;
+			// Upsample back to the first level, each level replacing the downsampled contents of the one above
+			for (level = (int)mip_chain.size() - 1; level > 0; level--)
+			{
+				MipLevel& dst = mip_chain[level - 1];
+				#pragma omp for schedule(dynamic, 1) private(channel)
+				for (y = 0; y < dst.height; y++)
+				{
+					for (channel = 0; channel < 4; channel++)
+					{
+						if (channel_mask & (1u << channel))
+						{
+							dualFilterUpsampleRow(mip_chain[level], dst.width, y, channel, dst.planes[channel].data() + (std::size_t)y * dst.width);
+						}
+					}
+				}
+			}
 
-	for (int offset = -KERNEL_RADIUS; offset <= KERNEL_RADIUS; offset++)
-	{
-		int offset_x = axis == 0 ? offset : 0;
-		int offset_y = axis == 1 ? offset : 0;
-		int pixel_y = std::max(std::min(y + offset_y, height - 1), 0);
-		int pixel_x = std::max(std::min(x + offset_x, width - 1), 0);
-		int pixel = pixel_y * width + pixel_x;
+			// Last upsample to full resolution, then composite
+			#pragma omp for schedule(dynamic, 1) private(x, channel)
+			for (y = 0; y < height; y++)
+			{
+				for (channel = 0; channel < 4; channel++)
+				{
+					unsigned char* dst = planar_blurred_mask.row(channel, y);
+					if (!(channel_mask & (1u << channel)))
+					{
+						std::memset(dst, img_in[channel], width);
+						continue;
+					}
+					dualFilterUpsampleRow(mip_chain[0], width, y, channel, upsampled_row.data());
+					for (x = 0; x < width; x++)
+					{
+						dst[x] = (unsigned char)std::min(upsampled_row[x] + 0.5f, 255.f);
+					}
+				}
+				interleaveRow(planar_blurred_mask, blurred_mask + 4 * y * width, y);
+				std::size_t offset = 4 * (std::size_t)y * width;
+				if (linear_light)
+				{
+					compositeLinearRow(img_in + offset, blurred_mask + offset, img_final + offset, width);
+					encodeLinearRow(blurred_mask + offset, width);
+				}
+				else
+				{
+					addSaturatedRow(img_in + offset, blurred_mask + offset, img_final + offset, 4 * width);
+				}
+			}
+		}
+		else
+		{
+			// Horizontal Blur of the active tiles, zeros elsewhere
+			#pragma omp for schedule(dynamic, 1) private(channel, tile_x)
+			for (y = 0; y < height; y++)
+			{
+				for (tile_x = 0; tile_x < tiles_x; tile_x++)
+				{
+					int x_begin = tile_x * BLOOM_TILE_SIZE;
+					int groups = std::min(x_begin + BLOOM_TILE_SIZE, 4 * bloom_mask.groups) / 4 - x_begin / 4;
+					bool active = horizontal_active[(y / BLOOM_TILE_SIZE) * tiles_x + tile_x];
+					for (channel = 0; channel < 4; channel++)
+					{
+						if (!(channel_mask & (1u << channel)))
+						{
+							continue;
+						}
+						unsigned char* dst = planar_horizontal_blur.row(channel, y) + x_begin;
+						if (active)
+						{
+							blurSpan_scalar(bloom_mask.row(channel, y) + x_begin, dst, groups, 1, weights);
+						}
+						else
+						{
+							std::memset(dst, 0, 4 * groups);
+						}
+					}
+				}
+			}
+
+			#pragma omp for
+			for (channel = 0; channel < 4; channel++)
+			{
+				if (channel_mask & (1u << channel))
+				{
+					planar_horizontal_blur.padTopBottom(channel);
+				}
+			}
+
+			// Vertical Blur of the active tiles, then composite: the blurred mask is added to the input
+			// in active tiles and the input is copied straight through elsewhere
+			#pragma omp for schedule(dynamic, 1) private(channel, tile_x)
+			for (y = 0; y < height; y++)
+			{
+				for (tile_x = 0; tile_x < tiles_x; tile_x++)
+				{
+					int x_begin = tile_x * BLOOM_TILE_SIZE;
+					int groups = std::min(x_begin + BLOOM_TILE_SIZE, 4 * planar_blurred_mask.groups) / 4 - x_begin / 4;
+					bool active = vertical_active[(y / BLOOM_TILE_SIZE) * tiles_x + tile_x];
+					for (channel = 0; channel < 4; channel++)
+					{
+						unsigned char* dst = planar_blurred_mask.row(channel, y) + x_begin;
+						if (!(channel_mask & (1u << channel)))
+						{
+							std::memset(dst, img_in[channel], 4 * groups);
+						}
+						else if (active)
+						{
+							blurSpan_scalar(planar_horizontal_blur.row(channel, y) + x_begin, dst, groups, planar_horizontal_blur.stride, weights);
+						}
+						else
+						{
+							std::memset(dst, 0, 4 * groups);
+						}
+					}
+				}
+				interleaveRow(planar_blurred_mask, blurred_mask + 4 * y * width, y);
 
-		float weight = std::exp(-(offset * offset) / (2.f * sigma * sigma));
+				for (tile_x = 0; tile_x < tiles_x; tile_x++)
+				{
+					int x_begin = tile_x * BLOOM_TILE_SIZE;
+					std::size_t offset = 4 * ((std::size_t)y * width + x_begin);
+					int bytes = 4 * (std::min(x_begin + BLOOM_TILE_SIZE, width) - x_begin);
+					if (!vertical_active[(y / BLOOM_TILE_SIZE) * tiles_x + tile_x])
+					{
+						std::memcpy(img_final + offset, img_in + offset, bytes);
+					}
+					else if (linear_light)
+					{
+						compositeLinearRow(img_in + offset, blurred_mask + offset, img_final + offset, bytes / 4);
+						encodeLinearRow(blurred_mask + offset, bytes / 4);
+					}
+					else
+					{
+						addSaturatedRow(img_in + offset, blurred_mask + offset, img_final + offset, bytes);
+					}
+				}
+			}
+		}
+	}
+	
 
-		ret += weight * input[4 * pixel + channel];
-		sum_weight += weight;
+	// Timer to measure performance
+	auto end = std::chrono::high_resolution_clock::now();
+	// Computation time in milliseconds
+	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+	printf("Maximum Pixel Luminance: %d%s\n", max_luminance, linear_light ? " (12-bit linear)" : "");
+	std::string prefix = "images/bloom";
+	if (mode == BLOOM_DUAL_FILTER)
+	{
+		printf("Bloom - Parallel, dual filter%s (%d channels, %d levels): Time %dms\n", linear_light ? ", linear light" : "", channelCount(channel_mask), BLOOM_MIP_LEVELS, time);
+		prefix += "_dual_filter";
+	}
+	else
+	{
+		printf("Bloom - Parallel%s (%d channels, %d of %d tiles blurred): Time %dms\n", linear_light ? ", linear light" : "", channelCount(channel_mask), active_tiles, tiles_x * tiles_y, time);
+	}
+	if (linear_light)
+	{
+		prefix += "_linear";
 	}
-	ret /= sum_weight;
 
-	return (unsigned char)std::max(std::min(ret, 255.f), 0.f);
-}
+	// Write the blurred image into a JPG file
+	stbi_write_jpg((prefix + "_blurred.jpg").c_str(), width, height, 4/*channels*/, blurred_mask, 90 /*quality*/);
+	stbi_write_jpg((prefix + "_final.jpg").c_str(), width, height, 4/*channels*/, img_final, 90 /*quality*/);
 
+	stbi_image_free(img_in);
+	delete[] blurred_mask;
+	delete[] luminance;
+	delete[] img_final;
+}
 
-void gaussian_blur_separate_serial(const char* filename)
+// Bloom with a single intermediate image. The first sweep only finds the maximum luminance.
+// The horizontal pass then thresholds each row into a small per-thread mask row right before
+// blurring it, and the vertical pass composites each output row with the input as soon as it
+// is blurred, so the luminance, mask and blurred mask images of bloom_parallel are never stored.
+void bloom_fused(const char* filename, bool skip_constant_channels)
 {
 	int width = 0;
 	int height = 0;
@@ -51,257 +2850,308 @@ void gaussian_blur_separate_serial(const char* filename)
 		return;
 	}
 
-	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
-	unsigned char* img_out = new unsigned char[width * height * 4];
+	unsigned char* img_final = new unsigned char[width * height * 4];
+	// The only intermediate: the horizontally blurred mask, padded for the vertical pass
+	PlanarImage planar_horizontal_blur(width, height, KERNEL_RADIUS);
+	unsigned char max_luminance = 0;
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+	// Vector kernels for the widest instruction set this CPU supports
+	BlurSpanFunc<float> blur_span = selectBlurSpan(simd_level);
 
 	// Timer to measure performance
 	auto start = std::chrono::high_resolution_clock::now();
 
-	// Horizontal Blur
-	for (int y = 0; y < height; y++)
+	unsigned channel_mask = skip_constant_channels ? bloomChannels(img_in, width, height) : ALL_CHANNELS;
+
+	#pragma omp parallel
 	{
-		for (int x = 0; x < width; x++)
+		// One padded mask row and one blurred output row per thread
+		PlanarImage mask_row(width, 1, KERNEL_RADIUS);
+		PlanarImage blurred_row(width, 1);
+		std::vector<unsigned char> blurred_rgba(4 * (std::size_t)width);
+
+		// calculate max luminance of all pixels
+		int y, x, pixel, channel;
+		unsigned char local_max_luminance = 0;
+		#pragma omp for schedule(dynamic, 1) private(x, pixel)
+		for (y = 0; y < height; y++)
 		{
-			int pixel = y * width + x;
-			for (int channel = 0; channel < 4; channel++)
+			for (x = 0; x < width; x++)
 			{
-				img_horizontal_blur[4 * pixel + channel] = blurAxis(x, y, channel, 0, img_in, width, height);
+				pixel = y * width + x;
+				unsigned char luminance = (img_in[4 * pixel] + img_in[4 * pixel + 1] + img_in[4 * pixel + 2]) / 3;
+				local_max_luminance = std::max(local_max_luminance, luminance);
 			}
 		}
-	}
-	// Vertical Blur
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++)
+
+		#pragma omp critical
 		{
-			int pixel = y * width + x;
-			for (int channel = 0; channel < 4; channel++)
+			if (local_max_luminance > max_luminance) {
+				max_luminance = local_max_luminance;
+			}
+		}
+		// The threshold needs the maximum of every thread
+		#pragma omp barrier
+
+		// Threshold each row into the mask row, then blur it horizontally
+		float threshold = 0.9f * max_luminance;
+		#pragma omp for schedule(dynamic, 1) private(x, pixel, channel)
+		for (y = 0; y < height; y++)
+		{
+			for (x = 0; x < width; x++)
+			{
+				pixel = y * width + x;
+				unsigned char luminance = (img_in[4 * pixel] + img_in[4 * pixel + 1] + img_in[4 * pixel + 2]) / 3;
+				bool bright = luminance > threshold;
+				for (channel = 0; channel < 4; channel++)
+				{
+					mask_row.row(channel, 0)[x] = bright ? img_in[4 * pixel + channel] : 0;
+				}
+			}
+
+			for (channel = 0; channel < 4; channel++)
+			{
+				if (channel_mask & (1u << channel))
+				{
+					mask_row.padRowEdges(channel, 0);
+					blur_span(mask_row.row(channel, 0), planar_horizontal_blur.row(channel, y), mask_row.groups, 1, weights);
+				}
+			}
+		}
+
+		#pragma omp for
+		for (channel = 0; channel < 4; channel++)
+		{
+			if (channel_mask & (1u << channel))
+			{
+				planar_horizontal_blur.padTopBottom(channel);
+			}
+		}
+
+		// Blur each row vertically and add it to the input, saturating at 255
+		#pragma omp for schedule(dynamic, 1) private(channel)
+		for (y = 0; y < height; y++)
+		{
+			for (channel = 0; channel < 4; channel++)
 			{
-				img_out[4 * pixel + channel] = blurAxis(x, y, channel, 1, img_horizontal_blur, width, height);
+				if (channel_mask & (1u << channel))
+				{
+					blur_span(planar_horizontal_blur.row(channel, y), blurred_row.row(channel, 0), blurred_row.groups, planar_horizontal_blur.stride, weights);
+				}
+				else
+				{
+					std::memset(blurred_row.row(channel, 0), img_in[channel], width);
+				}
 			}
+			interleaveRow(blurred_row, blurred_rgba.data(), 0);
+			addSaturatedRow(img_in + 4 * (std::size_t)y * width, blurred_rgba.data(), img_final + 4 * (std::size_t)y * width, 4 * width);
 		}
 	}
+
 	// Timer to measure performance
 	auto end = std::chrono::high_resolution_clock::now();
 	// Computation time in milliseconds
 	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-	printf("Gaussian Blur Separate - Serial: Time %dms\n", time);
+	printf("Maximum Pixel Luminance: %d\n", max_luminance);
+	printf("Bloom - Fused (%s, %d channels): Time %dms\n", simdLevelName(simd_level), channelCount(channel_mask), time);
 
-	// Write the blurred image into a JPG file
-	stbi_write_jpg("images/blurred_separate.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+	// Write the final image into a JPG file
+	stbi_write_jpg("images/bloom_fused.jpg", width, height, 4/*channels*/, img_final, 90 /*quality*/);
 
 	stbi_image_free(img_in);
-	delete[] img_horizontal_blur;
-	delete[] img_out;
+	delete[] img_final;
 }
 
-void gaussian_blur_separate_parallel(const char* filename)
+// Separable blur on linear float RGBA, with a single tone mapping and quantization at the end
+void gaussian_blur_separate_hdr(const char* filename)
 {
 	int width = 0;
 	int height = 0;
-	int img_orig_channels = 4;
-	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
-	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	// Load an image as linear floats, width * height * 4 of them
+	float* img_in = loadImageFloat(filename, &width, &height);
 	if (img_in == nullptr)
 	{
 		printf("Could not load %s\n", filename);
 		return;
 	}
 
-	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
+	float* img_horizontal_blur = new float[width * height * 4];
+	float* img_blurred = new float[width * height * 4];
 	unsigned char* img_out = new unsigned char[width * height * 4];
 
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
+
 	// Timer to measure performance
 	auto start = std::chrono::high_resolution_clock::now();
 
-	// Horizontal Blur
-	int y, x, pixel, channel;
-	#pragma omp parallel for schedule(dynamic, 1) private(x, pixel, channel)
-	for (y = 0; y < height; y++)
+	#pragma omp parallel
 	{
-		for (x = 0; x < width; x++)
+		std::vector<float> padded_row(4 * ((std::size_t)width + 2 * KERNEL_RADIUS));
+		int y;
+
+		// Horizontal Blur
+		#pragma omp for schedule(dynamic, 1)
+		for (y = 0; y < height; y++)
 		{
-			pixel = y * width + x;
-			for (channel = 0; channel < 4; channel++)
-			{
-				img_horizontal_blur[4 * pixel + channel] = blurAxis(x, y, channel, 0, img_in, width, height);
-			}
+			blurRowHorizontalFloat(img_in, img_horizontal_blur + 4 * (std::size_t)y * width, y, width, weights, padded_row.data());
+		}
+
+		// Vertical Blur
+		#pragma omp for schedule(dynamic, 1)
+		for (y = 0; y < height; y++)
+		{
+			blurRowVerticalFloat(img_horizontal_blur, img_blurred + 4 * (std::size_t)y * width, y, width, height, weights);
 		}
 	}
 
-	// Vertical Blur
-	#pragma omp parallel for schedule(dynamic, 1) private(x, pixel, channel)
+	float white = whitePoint(img_blurred, width, height);
+	int y;
+	#pragma omp parallel for schedule(dynamic, 1)
 	for (y = 0; y < height; y++)
 	{
-		for (x = 0; x < width; x++)
-		{
-			pixel = y * width + x;
-			for (channel = 0; channel < 4; channel++)
-			{
-				img_out[4 * pixel + channel] = blurAxis(x, y, channel, 1, img_horizontal_blur, width, height);
-			}
-		}
+		toneMapRow(img_blurred + 4 * (std::size_t)y * width, img_out + 4 * (std::size_t)y * width, width, white);
 	}
 
 	// Timer to measure performance
 	auto end = std::chrono::high_resolution_clock::now();
 	// Computation time in milliseconds
 	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-	printf("Gaussian Blur Separate - Parallel: Time %dms\n", time);
+	printf("Gaussian Blur Separate - HDR (%s): Time %dms\n", simdLevelName(simd_level), time);
 
 	// Write the blurred image into a JPG file
-	stbi_write_jpg("images/blurred_image_parallel.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
+	stbi_write_jpg("images/blurred_hdr.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
 
 	stbi_image_free(img_in);
 	delete[] img_horizontal_blur;
+	delete[] img_blurred;
 	delete[] img_out;
 }
 
-void bloom_parallel(const char* filename)
+// Bloom on linear float RGBA. The mask, both blur passes and the composite keep full float
+// range, and the sum of the image and the glow is tone mapped with its own white point.
+void bloom_hdr(const char* filename)
 {
-
 	int width = 0;
 	int height = 0;
-	int img_orig_channels = 4;
-	// Load an image into an array of unsigned chars that is the size of width * height * number of channels. The channels are the Red, Green, Blue and Alpha channels of the image.
-	unsigned char* img_in = stbi_load(filename, &width, &height, &img_orig_channels /*image file channels*/, 4 /*requested channels*/);
+	// Load an image as linear floats, width * height * 4 of them
+	float* img_in = loadImageFloat(filename, &width, &height);
 	if (img_in == nullptr)
 	{
 		printf("Could not load %s\n", filename);
 		return;
 	}
 
-	unsigned char* img_horizontal_blur = new unsigned char[width * height * 4];
-	unsigned char* img_final = new unsigned char[width * height * 4];
-	unsigned char* blurred_mask = new unsigned char[width * height * 4];
-	unsigned char* bloom_mask = new unsigned char[width * height * 4];
-	unsigned char* luminance = new unsigned char[width * height];
-	unsigned char max_luminance = 0;
+	float* bloom_mask = new float[width * height * 4];
+	float* img_horizontal_blur = new float[width * height * 4];
+	float* img_final = new float[width * height * 4];
+	unsigned char* img_out = new unsigned char[width * height * 4];
+	float max_luminance = 0.f;
+
+	// Normalized blur weights, cached across calls
+	const float* weights = GaussianKernelBank::get(sigma, KERNEL_RADIUS);
 
 	// Timer to measure performance
 	auto start = std::chrono::high_resolution_clock::now();
 
-
 	#pragma omp parallel
 	{
+		std::vector<float> padded_row(4 * ((std::size_t)width + 2 * KERNEL_RADIUS));
+		int y, x, channel, pixel;
+
 		// calculate max luminance of all pixels
-		int y, x, pixel, channel;
-		unsigned char local_max_luminance = 0;
-		#pragma omp for schedule(dynamic, 1) private(x, pixel)
-		for (y = 0; y < height; y++)
+		float local_max_luminance = 0.f;
+		#pragma omp for
+		for (pixel = 0; pixel < width * height; pixel++)
 		{
-			for (x = 0; x < width; x++)
-			{
-				pixel = y * width + x;
-				luminance[pixel] = (img_in[4 * pixel] + img_in[4 * pixel + 1] + img_in[4 * pixel + 2]) / 3;
-
-				if (luminance[pixel] > local_max_luminance) {
-					local_max_luminance = luminance[pixel];
-				}
-			}
+			local_max_luminance = std::max(local_max_luminance, (img_in[4 * pixel] + img_in[4 * pixel + 1] + img_in[4 * pixel + 2]) / 3.f);
 		}
 
 		#pragma omp critical
 		{
-			if (local_max_luminance > max_luminance) {
-				max_luminance = local_max_luminance;
-			}
-		}
-
-		// create bloom_mask image
-		#pragma omp for schedule(dynamic, 1) private(x, pixel, channel)
-		for (y = 0; y < height; y++)
-		{
-			for (x = 0; x < width; x++)
-			{
-				pixel = y * width + x;
-				if (luminance[pixel] > 0.9f * max_luminance) {
-					for (channel = 0; channel < 4; channel++)
-					{
-						bloom_mask[4 * pixel + channel] = img_in[4 * pixel + channel];
-					}
-				}else {
-					bloom_mask[4 * pixel] = 0;
-					bloom_mask[4 * pixel + 1] = 0;
-					bloom_mask[4 * pixel + 2] = 0;
-					bloom_mask[4 * pixel + 3] = 0;
-				}
-			}
-		}
-
-		// Horizontal Blur
-		#pragma omp for schedule(dynamic, 1) private(x, pixel, channel)
-		for (y = 0; y < height; y++)
-		{
-			for (x = 0; x < width; x++)
-			{
-				pixel = y * width + x;
-				for (channel = 0; channel < 4; channel++)
-				{
-					img_horizontal_blur[4 * pixel + channel] = blurAxis(x, y, channel, 0, bloom_mask, width, height);
-				}
-			}
+			max_luminance = std::max(max_luminance, local_max_luminance);
 		}
+		// The threshold needs the maximum of every thread
+		#pragma omp barrier
 
-		// Vertical Blur
-		#pragma omp for schedule(dynamic, 1) private(x, pixel, channel)
+		// Threshold each row into the mask, then blur it horizontally
+		#pragma omp for schedule(dynamic, 1) private(x, channel)
 		for (y = 0; y < height; y++)
 		{
+			const float* row = img_in + 4 * (std::size_t)y * width;
+			float* mask_row = bloom_mask + 4 * (std::size_t)y * width;
 			for (x = 0; x < width; x++)
 			{
-				pixel = y * width + x;
+				bool bright = (row[4 * x] + row[4 * x + 1] + row[4 * x + 2]) / 3.f > 0.9f * max_luminance;
 				for (channel = 0; channel < 4; channel++)
 				{
-					blurred_mask[4 * pixel + channel] = blurAxis(x, y, channel, 1, img_horizontal_blur, width, height);
+					mask_row[4 * x + channel] = bright ? row[4 * x + channel] : 0.f;
 				}
 			}
+			blurRowHorizontalFloat(bloom_mask, img_horizontal_blur + 4 * (std::size_t)y * width, y, width, weights, padded_row.data());
 		}
 
-		int sum;
-		#pragma omp for schedule(dynamic, 1) private(x, pixel, channel, sum)
+		// Vertical Blur, then add the glow to the input without clamping
+		#pragma omp for schedule(dynamic, 1) private(x)
 		for (y = 0; y < height; y++)
 		{
-			for (x = 0; x < width; x++)
+			float* final_row = img_final + 4 * (std::size_t)y * width;
+			blurRowVerticalFloat(img_horizontal_blur, final_row, y, width, height, weights);
+			const float* row = img_in + 4 * (std::size_t)y * width;
+			for (x = 0; x < 4 * width; x++)
 			{
-				pixel = y * width + x;
-				for (channel = 0; channel < 4; channel++)
-				{
-					sum = img_in[4 * pixel + channel] + blurred_mask[4 * pixel + channel];
-					if (sum > 255) sum = 255;
-					img_final[4 * pixel + channel] = (unsigned char)sum;
-				}
+				final_row[x] += row[x];
 			}
 		}
+	}
 
+	float white = whitePoint(img_final, width, height);
+	int y;
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (y = 0; y < height; y++)
+	{
+		toneMapRow(img_final + 4 * (std::size_t)y * width, img_out + 4 * (std::size_t)y * width, width, white);
 	}
-	
 
 	// Timer to measure performance
 	auto end = std::chrono::high_resolution_clock::now();
 	// Computation time in milliseconds
 	int time = (int)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-	printf("Maximum Pixel Luminance: %d\n", max_luminance);
-	printf("Bloom - Parallel: Time %dms\n", time);
+	printf("Maximum Pixel Luminance: %.3f, white point %.3f\n", max_luminance, white);
+	printf("Bloom - HDR (%s): Time %dms\n", simdLevelName(simd_level), time);
 
-	// Write the blurred image into a JPG file
-	stbi_write_jpg("images/bloom_blurred.jpg", width, height, 4/*channels*/, blurred_mask, 90 /*quality*/);
-	stbi_write_jpg("images/bloom_final.jpg", width, height, 4/*channels*/, img_final, 90 /*quality*/);
+	// Write the final image into a JPG file
+	stbi_write_jpg("images/bloom_hdr_final.jpg", width, height, 4/*channels*/, img_out, 90 /*quality*/);
 
 	stbi_image_free(img_in);
-	delete[] img_horizontal_blur;
-	delete[] blurred_mask;
 	delete[] bloom_mask;
-	delete[] luminance;
+	delete[] img_horizontal_blur;
 	delete[] img_final;
+	delete[] img_out;
 }
 
 int main()
 {
 	const char* filename = "images/street_night.jpg";
 	gaussian_blur_separate_serial(filename);
+	gaussian_blur_recursive(filename, sigma);
 	gaussian_blur_separate_parallel(filename);
+	gaussian_blur_box_parallel(filename, 3);
+	gaussian_blur_separate_simd(filename);
+	gaussian_blur_separate_planar(filename, true);
+	gaussian_blur_separate_fixed(filename);
+	gaussian_blur_separate_fixed16(filename);
+	gaussian_blur_separate_fused(filename);
 	
-	bloom_parallel(filename);
+	bloom_parallel(filename, BLOOM_GAUSSIAN, true, false);
+	bloom_parallel(filename, BLOOM_GAUSSIAN, true, true);
+	bloom_parallel(filename, BLOOM_DUAL_FILTER, true, false);
+	bloom_fused(filename, true);
+
+	gaussian_blur_separate_hdr(filename);
+	bloom_hdr(filename);
 
 	return 0;
 }
\ No newline at end of file
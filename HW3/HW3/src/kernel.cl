@@ -1,4 +1,13 @@
-const int KERNEL_RADIUS = 8;
+#define KERNEL_RADIUS 8
+
+// Work-group edge of the tiled kernel: blurAxisTiled requires BLUR_TILE_SIZE x BLUR_TILE_SIZE work-groups,
+// and the host uses the same size for every kernel variant.
+#define BLUR_TILE_SIZE 16
+// Tile length along the blur axis: the work-group's pixels plus KERNEL_RADIUS halo pixels on each side
+#define BLUR_TILE_SPAN (BLUR_TILE_SIZE + 2 * KERNEL_RADIUS)
+
+// Consecutive pixels of a row blurred by one work-item of blurAxisVector
+#define BLUR_VECTOR_PIXELS 4
 
 __kernel void blurAxis(
     __global const uchar* input,
@@ -16,10 +25,30 @@ __kernel void blurAxis(
 
     int pixel_index = y * width + x;
 
+    // Interior work-items have all taps inside the image and read them without clamping.
+    // Only the outer KERNEL_RADIUS columns (or rows) take the clamped path below.
+    int position = axis == 0 ? x : y;
+    int extent = axis == 0 ? width : height;
+    if (position >= KERNEL_RADIUS && position < extent - KERNEL_RADIUS)
+    {
+        int tap_stride = axis == 0 ? 4 : 4 * width;
+        __global const uchar* taps = input + 4 * pixel_index - KERNEL_RADIUS * tap_stride;
+
+        for (int channel = 0; channel < 4; channel++)
+        {
+            float ret = 0.0f;
+            for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+            {
+                ret += weights[k] * taps[k * tap_stride + channel];
+            }
+            output[4 * pixel_index + channel] = (uchar)(clamp(ret, 0.0f, 255.0f));
+        }
+        return;
+    }
+
     for (int channel = 0; channel < 4; channel++)
     {
         float ret = 0.0f;
-        float sum_weight = 0.0f;
 
         for (int offset = -KERNEL_RADIUS; offset <= KERNEL_RADIUS; offset++)
         {
@@ -30,13 +59,124 @@ __kernel void blurAxis(
 		    int pixel_x = clamp(x + offset_x, 0, width - 1);
             int pixel = pixel_y * width + pixel_x;
 
-            float weight = weights[offset + KERNEL_RADIUS];
-            ret += weight * input[4 * pixel + channel];
-            sum_weight += weight;
+            // weights are normalized on the host, so no division by their sum is needed
+            ret += weights[offset + KERNEL_RADIUS] * input[4 * pixel + channel];
         }
 
-        ret /= sum_weight;
         output[4 * pixel_index + channel] = (uchar)(clamp(ret, 0.0f, 255.0f));
 
     }
-}
\ No newline at end of file
+}
+
+// Same result as blurAxis, but the work-group first copies its pixels and the halo around them
+// into local memory, so each input byte is read from global memory about once per work-group
+// instead of once per tap. The tile is stored like a small image, BLUR_TILE_SPAN pixels along
+// the blur axis and BLUR_TILE_SIZE pixels across it, with edge pixels clamped as in blurAxis.
+__kernel __attribute__((reqd_work_group_size(BLUR_TILE_SIZE, BLUR_TILE_SIZE, 1)))
+void blurAxisTiled(
+    __global const uchar* input,
+    __global uchar* output,
+    __constant  float* weights,
+    const int width,
+    const int height,
+    const int axis)
+{
+    __local uchar tile[BLUR_TILE_SIZE * BLUR_TILE_SPAN * 4];
+
+    int local_x = get_local_id(0);
+    int local_y = get_local_id(1);
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    int tile_width = axis == 0 ? BLUR_TILE_SPAN : BLUR_TILE_SIZE;
+    int tile_height = axis == 0 ? BLUR_TILE_SIZE : BLUR_TILE_SPAN;
+    int origin_x = get_group_id(0) * BLUR_TILE_SIZE - (axis == 0 ? KERNEL_RADIUS : 0);
+    int origin_y = get_group_id(1) * BLUR_TILE_SIZE - (axis == 1 ? KERNEL_RADIUS : 0);
+
+    // Consecutive work-items load consecutive bytes of a tile row, so the loads are coalesced.
+    // Work-items outside the image still load, since every work-item has to reach the barrier.
+    int row_bytes = 4 * tile_width;
+    for (int i = local_y * BLUR_TILE_SIZE + local_x; i < row_bytes * tile_height; i += BLUR_TILE_SIZE * BLUR_TILE_SIZE)
+    {
+        int row = i / row_bytes;
+        int column = i - row * row_bytes;
+        int pixel_y = clamp(origin_y + row, 0, height - 1);
+        int pixel_x = clamp(origin_x + column / 4, 0, width - 1);
+        tile[i] = input[4 * (pixel_y * width + pixel_x) + (column & 3)];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (x >= width || y >= height)
+        return;
+
+    // Tap 0 of this work-item sits KERNEL_RADIUS pixels before it along the axis, which is where
+    // the halo starts, so it is at the work-item's own local coordinates in the tile
+    int tap_stride = axis == 0 ? 4 : row_bytes;
+    __local const uchar* taps = tile + local_y * row_bytes + 4 * local_x;
+    int pixel_index = y * width + x;
+
+    for (int channel = 0; channel < 4; channel++)
+    {
+        float ret = 0.0f;
+        for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+        {
+            ret += weights[k] * taps[k * tap_stride + channel];
+        }
+        output[4 * pixel_index + channel] = (uchar)(clamp(ret, 0.0f, 255.0f));
+    }
+}
+
+// Same blur as blurAxis, but each pixel is loaded as one uchar4 and all four channels are
+// convolved together as a float4. A work-item blurs BLUR_VECTOR_PIXELS consecutive pixels of
+// a row, so the host launches width / BLUR_VECTOR_PIXELS work-items along x. Horizontally the
+// pixels share all but BLUR_VECTOR_PIXELS of their taps, which are loaded once into a window.
+// Tap coordinates are always clamped: it is one min/max per pixel load, not per channel.
+__kernel void blurAxisVector(
+    __global const uchar* input,
+    __global uchar* output,
+    __constant  float* weights,
+    const int width,
+    const int height,
+    const int axis)
+{
+    int x = get_global_id(0) * BLUR_VECTOR_PIXELS;
+    int y = get_global_id(1);
+
+    if (x >= width || y >= height)
+        return;
+
+    int count = min(BLUR_VECTOR_PIXELS, width - x);
+
+    if (axis == 0)
+    {
+        float4 window[BLUR_VECTOR_PIXELS + 2 * KERNEL_RADIUS];
+        for (int i = 0; i < BLUR_VECTOR_PIXELS + 2 * KERNEL_RADIUS; i++)
+        {
+            int pixel_x = clamp(x - KERNEL_RADIUS + i, 0, width - 1);
+            window[i] = convert_float4(vload4(y * width + pixel_x, input));
+        }
+
+        for (int p = 0; p < count; p++)
+        {
+            float4 ret = 0.0f;
+            for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+            {
+                ret += weights[k] * window[p + k];
+            }
+            vstore4(convert_uchar4_sat(ret), y * width + x + p, output);
+        }
+        return;
+    }
+
+    for (int p = 0; p < count; p++)
+    {
+        float4 ret = 0.0f;
+        for (int k = 0; k < 2 * KERNEL_RADIUS + 1; k++)
+        {
+            int pixel_y = clamp(y - KERNEL_RADIUS + k, 0, height - 1);
+            ret += weights[k] * convert_float4(vload4(pixel_y * width + x + p, input));
+        }
+        // convert_uchar4_sat rounds toward zero like the (uchar) casts of the scalar kernels
+        vstore4(convert_uchar4_sat(ret), y * width + x + p, output);
+    }
+}